@@ -0,0 +1,403 @@
+// (c) L. Farhi, 2024
+// Language: C (C11 or higher)
+// Benchmark of a map compared to reference structures of the C library, under identical workloads.
+// Usage: bench_compare [-n number of keys] [-r repetitions] [-k keys] [-s seed]
+// - keys: random, sorted, folded, zipf or duplicates (random by default).
+// The structures are:
+// - "map": a map (with a unicity constraint), as in map.h ;
+// - "sorted_array": a sorted array of pointers, searched with bsearch, and kept sorted on insertion and removal with memmove ;
+// - "tsearch": the binary tree of <search.h>, with tsearch, tfind, tdelete and twalk ;
+// - "hsearch": the hash table of <search.h>, with hsearch_r (it can neither remove elements nor be scanned in order: those phases are reported as null.)
+// Each structure runs, `repetitions` times, four phases on the same keys: insertion of the keys, find and removal in a random order, and an ordered scan in between.
+// For each phase, the best duration over the repetitions is reported, as nanoseconds per operation and operations per second.
+// The memory per element is the growth of the heap (mallinfo2) after the insertion phase, divided by the number of elements in the structure
+// (the keys themselves are not counted, they are stored outside of the structures.)
+// Results are printed on the standard output in JSON.
+#define _GNU_SOURCE // for getopt, clock_gettime, hsearch_r, tdestroy
+#include "bench_keys.c"
+#include <malloc.h>
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum phase { INSERTION, SEARCH, SCAN, REMOVAL, NB_PHASES }; // FIND and ENTER are already defined by <search.h>.
+static const char *const PHASES[NB_PHASES] = { "insert", "find", "scan", "remove" };
+
+static struct {
+  size_t nb_keys, repetitions;
+  enum keys keys;
+  uint64_t seed;
+} bench = { .nb_keys = 100 * 1000, .repetitions = 3, .keys = RANDOM, .seed = 1 };
+
+static int *keys;
+static char (*names)[12]; // The keys as strings, for hsearch.
+
+static int
+cmp_pointed (const void *a, const void *b) {
+  return cmp_int (*(const int *const *)a, *(const int *const *)b, 0);
+}
+
+static int
+cmp_int2 (const void *a, const void *b) {
+  return cmp_int (a, b, 0);
+}
+
+static size_t
+heap_used (void) {
+  struct mallinfo2 info = mallinfo2 ();
+  return info.uordblks + info.hblkhd;
+}
+
+// A structure under test: each operation is called with the index of a key, and returns 0 if it failed (rejected insertion, key not found) or is not supported.
+struct structure {
+  const char *name;
+  int (*create) (size_t nb);
+  int (*insert) (size_t i);
+  int (*find) (size_t i);
+  long long (*scan) (void); // Sum of the keys, in order.
+  int (*remove) (size_t i);
+  size_t (*size) (void);
+  void (*destroy) (void);
+};
+
+// map.h
+static map *m;
+
+static int
+sum (void *data, void *op_arg, int *remove, const void *context) {
+  (void)remove;
+  (void)context;
+  *(long long *)op_arg += *(int *)data;
+  return 1;
+}
+
+static int
+map_create_ (size_t nb) {
+  (void)nb;
+  return !!(m = map_create (0, cmp_int, 0, 1));
+}
+
+static int
+map_insert_ (size_t i) {
+  return !!map_insert_data (m, &keys[i]);
+}
+
+static int
+map_find_ (size_t i) {
+  return !!map_find_key (m, &keys[i], MAP_EXISTS_ONE, 0, 0, 0);
+}
+
+static long long
+map_scan_ (void) {
+  long long total = 0;
+  map_traverse (m, sum, &total, 0, 0);
+  return total;
+}
+
+static int
+map_remove_ (size_t i) {
+  return !!map_find_key (m, &keys[i], MAP_REMOVE_ONE, 0, 0, 0);
+}
+
+static size_t
+map_size_ (void) {
+  return map_size (m);
+}
+
+static void
+map_destroy_ (void) {
+  map_destroy_all (m, 0);
+}
+
+// Sorted array and bsearch
+static struct {
+  const int **elements;
+  size_t size, capacity;
+} array;
+
+static size_t
+array_lower_bound (const int *key) { // bsearch does not tell where a missing key would be inserted.
+  size_t lo = 0, hi = array.size;
+  while (lo < hi)
+    if (*array.elements[(lo + hi) / 2] < *key)
+      lo = (lo + hi) / 2 + 1;
+    else
+      hi = (lo + hi) / 2;
+  return lo;
+}
+
+static int
+array_create (size_t nb) {
+  (void)nb; // The array grows as elements are inserted, as the other structures.
+  array.size = array.capacity = 0;
+  array.elements = 0;
+  return 1;
+}
+
+static int
+array_insert (size_t i) {
+  size_t pos = array_lower_bound (&keys[i]);
+  if (pos < array.size && *array.elements[pos] == keys[i])
+    return 0;
+  if (array.size == array.capacity) {
+    size_t capacity = array.capacity ? 2 * array.capacity : 16;
+    const int **elements = realloc (array.elements, capacity * sizeof (*elements));
+    if (!elements)
+      return 0;
+    array.elements = elements;
+    array.capacity = capacity;
+  }
+  memmove (array.elements + pos + 1, array.elements + pos, (array.size - pos) * sizeof (*array.elements));
+  array.elements[pos] = &keys[i];
+  array.size++;
+  return 1;
+}
+
+static int
+array_find (size_t i) {
+  const int *key = &keys[i];
+  return !!bsearch (&key, array.elements, array.size, sizeof (*array.elements), cmp_pointed);
+}
+
+static long long
+array_scan (void) {
+  long long total = 0;
+  for (size_t i = 0; i < array.size; i++)
+    total += *array.elements[i];
+  return total;
+}
+
+static int
+array_remove (size_t i) {
+  const int *key = &keys[i];
+  const int **found = bsearch (&key, array.elements, array.size, sizeof (*array.elements), cmp_pointed);
+  if (!found)
+    return 0;
+  memmove (found, found + 1, (size_t)(array.elements + array.size - found - 1) * sizeof (*array.elements));
+  array.size--;
+  return 1;
+}
+
+static size_t
+array_size (void) {
+  return array.size;
+}
+
+static void
+array_destroy (void) {
+  free (array.elements);
+}
+
+// tsearch
+static void *root;
+static size_t tree_size;
+static long long tree_total; // twalk does not pass any argument to its action.
+
+static void
+tree_sum (const void *node, VISIT visit, int depth) {
+  (void)depth;
+  if (visit == postorder || visit == leaf)
+    tree_total += **(const int *const *)node;
+}
+
+static void
+tree_free (void *data) {
+  (void)data;
+}
+
+static int
+tree_create (size_t nb) {
+  (void)nb;
+  root = 0;
+  tree_size = 0;
+  return 1;
+}
+
+static int
+tree_insert (size_t i) {
+  const int *const *node = tsearch (&keys[i], &root, cmp_int2);
+  if (!node || *node != &keys[i]) // Not enough memory, or already present.
+    return 0;
+  tree_size++;
+  return 1;
+}
+
+static int
+tree_find (size_t i) {
+  return !!tfind (&keys[i], &root, cmp_int2);
+}
+
+static long long
+tree_scan (void) {
+  tree_total = 0;
+  twalk (root, tree_sum);
+  return tree_total;
+}
+
+static int
+tree_remove (size_t i) {
+  if (!tdelete (&keys[i], &root, cmp_int2))
+    return 0;
+  tree_size--;
+  return 1;
+}
+
+static size_t
+tree_size_ (void) {
+  return tree_size;
+}
+
+static void
+tree_destroy (void) {
+  tdestroy (root, tree_free);
+}
+
+// hsearch_r
+static struct hsearch_data table;
+static size_t table_size;
+
+static int
+table_create (size_t nb) {
+  memset (&table, 0, sizeof (table));
+  table_size = 0;
+  return hcreate_r (2 * nb, &table); // The table can not grow: it is sized for a load factor of 1/2.
+}
+
+static int
+table_insert (size_t i) {
+  ENTRY *entry;
+  if (!hsearch_r ((ENTRY){ .key = names[i], .data = &keys[i] }, ENTER, &entry, &table) || entry->data != &keys[i])
+    return 0;
+  table_size++;
+  return 1;
+}
+
+static int
+table_find (size_t i) {
+  ENTRY *entry;
+  return hsearch_r ((ENTRY){ .key = names[i] }, FIND, &entry, &table);
+}
+
+static size_t
+table_size_ (void) {
+  return table_size;
+}
+
+static void
+table_destroy (void) {
+  hdestroy_r (&table);
+}
+
+static const struct structure STRUCTURES[] = {
+  { "map", map_create_, map_insert_, map_find_, map_scan_, map_remove_, map_size_, map_destroy_ },
+  { "sorted_array", array_create, array_insert, array_find, array_scan, array_remove, array_size, array_destroy },
+  { "tsearch", tree_create, tree_insert, tree_find, tree_scan, tree_remove, tree_size_, tree_destroy },
+  { "hsearch", table_create, table_insert, table_find, 0, 0, table_size_, table_destroy },
+};
+
+// compare runs the phases on a structure, `repetitions` times, and prints its results in JSON.
+static int
+compare (const struct structure *s, const size_t *perm, const char *separator) {
+  const size_t nb = bench.nb_keys;
+  uint64_t best[NB_PHASES] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+  size_t nb_elements = 0, nb_rejected = 0, nb_missed = 0, nb_bytes = 0;
+  long long total = 0;
+  for (size_t r = 0; r < bench.repetitions; r++) {
+    size_t heap = heap_used ();
+    if (!s->create (nb))
+      return 0;
+    nb_rejected = nb_missed = 0;
+    uint64_t t0 = now_ns ();
+    for (size_t i = 0; i < nb; i++)
+      nb_rejected += !s->insert (i);
+    uint64_t t1 = now_ns ();
+    nb_elements = s->size ();
+    nb_bytes = heap_used () - heap;
+    for (size_t i = 0; i < nb; i++)
+      nb_missed += !s->find (perm[i]);
+    uint64_t t2 = now_ns ();
+    if (s->scan)
+      total = s->scan ();
+    uint64_t t3 = now_ns ();
+    for (size_t i = 0; s->remove && i < nb; i++)
+      s->remove (perm[i]);
+    uint64_t t4 = now_ns ();
+    uint64_t durations[NB_PHASES] = { t1 - t0, t2 - t1, t3 - t2, t4 - t3 };
+    for (int p = 0; p < NB_PHASES; p++)
+      best[p] = durations[p] < best[p] ? durations[p] : best[p];
+    s->destroy ();
+  }
+  printf ("%s    {\"structure\": \"%s\", \"elements\": %zu, \"rejected\": %zu, \"missed\": %zu, \"sum\": %lld, \"bytes_per_element\": %.1f", separator, s->name,
+          nb_elements, nb_rejected, nb_missed, total, nb_elements ? (double)nb_bytes / (double)nb_elements : 0.);
+  for (int p = 0; p < NB_PHASES; p++) {
+    size_t nb_ops = p == SCAN ? nb_elements : nb;
+    if ((p == SCAN && !s->scan) || (p == REMOVAL && !s->remove) || !nb_ops)
+      printf (", \"%s\": null", PHASES[p]);
+    else
+      printf (", \"%s\": {\"ns_per_op\": %.1f, \"ops_per_s\": %.0f}", PHASES[p], (double)best[p] / (double)nb_ops,
+              best[p] ? (double)nb_ops * 1e9 / (double)best[p] : 0.);
+  }
+  printf ("}");
+  fflush (stdout);
+  return 1;
+}
+
+int
+main (int argc, char *argv[]) {
+  for (int opt; (opt = getopt (argc, argv, "n:r:k:s:")) != -1;)
+    switch (opt) {
+      case 'n':
+        bench.nb_keys = strtoul (optarg, 0, 10);
+        break;
+      case 'r':
+        bench.repetitions = strtoul (optarg, 0, 10);
+        break;
+      case 'k':
+        bench.keys = (enum keys)lookup (optarg, KEYS, NB_KEYS);
+        break;
+      case 's':
+        bench.seed = strtoull (optarg, 0, 10);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-n number of keys] [-r repetitions] [-k keys] [-s seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  if (!bench.nb_keys || !bench.repetitions) {
+    fprintf (stderr, "At least 1 key and 1 repetition are required.\n");
+    return EXIT_FAILURE;
+  }
+  const size_t nb = bench.nb_keys;
+  uint64_t state = bench.seed | 1; // xorshift needs a non-null state.
+  size_t *perm = malloc (nb * sizeof (*perm));
+  if (!(keys = malloc (nb * sizeof (*keys))) || !(names = malloc (nb * sizeof (*names))) || !perm)
+    return EXIT_FAILURE;
+  make_keys (keys, nb, bench.keys, &state);
+  for (size_t i = 0; i < nb; i++) {
+    snprintf (names[i], sizeof (names[i]), "%d", keys[i]);
+    perm[i] = i;
+  }
+  for (size_t i = nb - 1; i > 0; i--) { // A random order of access to the keys (Fisher-Yates shuffle).
+    size_t j = (size_t)(rng (&state) % (i + 1)), swap = perm[i];
+    perm[i] = perm[j];
+    perm[j] = swap;
+  }
+  printf ("{\n  \"benchmark\": \"compare\",\n  \"version\": \"%zu.%zu\",\n  \"nb_keys\": %zu,\n  \"keys\": \"%s\",\n  \"repetitions\": %zu,\n"
+          "  \"seed\": %llu,\n  \"results\": [\n",
+          MAP_VERSION_MAJOR, MAP_VERSION_MINOR, nb, KEYS[bench.keys], bench.repetitions, (unsigned long long)bench.seed);
+  const char *separator = "";
+  for (size_t s = 0; s < sizeof (STRUCTURES) / sizeof (*STRUCTURES); s++) {
+    if (!compare (&STRUCTURES[s], perm, separator)) {
+      fprintf (stderr, "Structure %s failed.\n", STRUCTURES[s].name);
+      return EXIT_FAILURE;
+    }
+    separator = ",\n";
+  }
+  printf ("\n  ]\n}\n");
+  free (perm);
+  free (names);
+  free (keys);
+  return EXIT_SUCCESS;
+}
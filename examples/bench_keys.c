@@ -0,0 +1,78 @@
+// Common definitions of the benchmarks of maps (included by bench_map.c and bench_map_mt.c): distributions of keys, random numbers and clock.
+#include "map.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum keys { RANDOM, SORTED, FOLDED, ZIPF, DUPLICATES, NB_KEYS };
+[[maybe_unused]] static const char *const KEYS[NB_KEYS] = { "random", "sorted", "folded", "zipf", "duplicates" };
+
+[[maybe_unused]] static uint64_t
+rng (uint64_t *state) { // xorshift64*: fast and reproducible. The state should not be null.
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+[[maybe_unused]] static uint64_t
+now_ns (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+[[maybe_unused]] static int
+cmp_int (const void *a, const void *b, const void *arg) {
+  (void)arg;
+  int ia = *(const int *)a, ib = *(const int *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+[[maybe_unused]] static void
+make_keys (int *keys, size_t nb, enum keys distribution, uint64_t *state) {
+  double *cdf = distribution == ZIPF ? malloc (nb * sizeof (*cdf)) : 0;
+  double total = 0;
+  for (size_t r = 0; cdf && r < nb; r++)
+    cdf[r] = (total += 1. / (double)(r + 1)); // Zipf (s = 1): rank r is drawn with a probability proportional to 1/r.
+  for (size_t i = 0; i < nb; i++)
+    switch (distribution) {
+      case RANDOM:
+        keys[i] = (int)(rng (state) >> 33); // Mostly distinct keys.
+        break;
+      case SORTED:
+        keys[i] = (int)i;
+        break;
+      case FOLDED: // 0, n-1, 1, n-2, 2, ...
+        keys[i] = (int)(i % 2 ? nb - 1 - i / 2 : i / 2);
+        break;
+      case ZIPF: {
+        double u = (double)(rng (state) >> 11) / 9007199254740992. * total;
+        size_t lo = 0, hi = nb - 1;
+        while (lo < hi)
+          if (cdf[(lo + hi) / 2] < u)
+            lo = (lo + hi) / 2 + 1;
+          else
+            hi = (lo + hi) / 2;
+        keys[i] = (int)lo;
+        break;
+      }
+      case DUPLICATES: // About 64 elements per key.
+        keys[i] = (int)(rng (state) % (nb / 64 + 1));
+        break;
+      default:
+        break;
+    }
+  free (cdf);
+}
+
+[[maybe_unused]] static int
+lookup (const char *name, const char *const *names, size_t nb) {
+  for (size_t i = 0; i < nb; i++)
+    if (!strcmp (name, names[i]))
+      return (int)i;
+  fprintf (stderr, "Unknown workload '%s'.\n", name);
+  exit (EXIT_FAILURE);
+}
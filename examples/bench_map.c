@@ -0,0 +1,330 @@
+// (c) L. Farhi, 2024
+// Language: C (C11 or higher)
+// Benchmark of the operations on a map, to check performance regressions.
+// Usage: bench_map [-n number of keys] [-r repetitions] [-w warmup runs] [-k keys] [-m mix] [-s seed] [-p]
+// - keys: random, sorted, folded, zipf or duplicates (all by default) ;
+// - mix: insert, find, scan, remove or mixed (all by default) ;
+// - p: hardware performance counters (cycles, instructions, L1 data, last level cache, branch and data TLB misses) per operation, with perf_event_open (Linux).
+//   Latencies are then not sampled, not to disturb the counters. Counters that are not available (not supported, or not permitted) are reported as null.
+// Each workload (keys, mix, unicity) runs in its own process (for its peak memory to be measured), `warmup` times, and then `repetitions` times.
+// Results are printed on the standard output in JSON, with the comparisons of keys and rotations per operation, and the final height of the tree.
+#define _DEFAULT_SOURCE // for getopt, fork, clock_gettime
+#include "bench_keys.c"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif
+
+enum mix { INSERT, FIND, SCAN, REMOVE, MIXED, NB_MIXES };
+static const char *const MIXES[NB_MIXES] = { "insert", "find", "scan", "remove", "mixed" };
+
+// One operation out of SAMPLING (a power of 2) is timed individually, for latency percentiles.
+#define SAMPLING 16
+
+static struct {
+  size_t nb_keys, repetitions, warmup;
+  uint64_t seed;
+  int perf;
+  size_t sampling_mask; // Operation i is timed if (i & sampling_mask) is 0.
+} bench = { .nb_keys = 100 * 1000, .repetitions = 5, .warmup = 1, .seed = 1, .sampling_mask = SAMPLING - 1 };
+
+enum counter { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, DTLB_MISSES, NB_COUNTERS };
+static const char *const COUNTERS[NB_COUNTERS] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses" };
+static int counter_fd[NB_COUNTERS] = { -1, -1, -1, -1, -1, -1 };
+static int counter_errno[NB_COUNTERS] = { ENOSYS, ENOSYS, ENOSYS, ENOSYS, ENOSYS, ENOSYS }; // Why a counter is not available
+static double counts[NB_COUNTERS];
+
+static void
+perf_open (void) {
+#ifdef __linux__
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[NB_COUNTERS] = {
+    [CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [L1D_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    [LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [DTLB_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  };
+  for (int c = 0; c < NB_COUNTERS; c++) {
+    struct perf_event_attr attr = { .size = sizeof (attr), .type = events[c].type, .config = events[c].config, .disabled = 1, .exclude_kernel = 1,
+                                    .exclude_hv = 1, .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING };
+    counter_fd[c] = (int)syscall (SYS_perf_event_open, &attr, 0 /* this process */, -1 /* any CPU */, -1 /* no group */, 0);
+    counter_errno[c] = counter_fd[c] < 0 ? errno : 0;
+  }
+#endif
+}
+
+static void
+perf_start (void) {
+#ifdef __linux__
+  for (int c = 0; c < NB_COUNTERS; c++)
+    if (counter_fd[c] >= 0) {
+      ioctl (counter_fd[c], PERF_EVENT_IOC_RESET, 0);
+      ioctl (counter_fd[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void
+perf_stop (void) {
+#ifdef __linux__
+  for (int c = 0; c < NB_COUNTERS; c++)
+    if (counter_fd[c] >= 0) {
+      ioctl (counter_fd[c], PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t value[3]; // Value, time enabled, time running.
+      if (read (counter_fd[c], value, sizeof (value)) == (ssize_t)sizeof (value) && value[2])
+        counts[c] += (double)value[0] * (double)value[1] / (double)value[2]; // Scaled if the counters were multiplexed.
+    }
+#endif
+}
+
+static uint64_t rng_state;
+static size_t nb_rejected; // Insertions rejected by the unicity constraint
+static size_t nb_comparisons, nb_rotations, nb_rebuilds, height; // Calls to the key comparator, rotations and rebuilds of the tree during the timed phase, and height of the tree at its end
+
+static int
+cmp_u64 (const void *a, const void *b) {
+  uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+  return (ua > ub) - (ua < ub);
+}
+
+static int
+sum (void *data, void *op_arg, int *remove, const void *context) {
+  (void)remove;
+  (void)context;
+  *(long long *)op_arg += *(int *)data;
+  return 1;
+}
+
+// run executes one repetition of a workload and returns its duration (in nanoseconds), and samples the latency of the operations into 'samples'.
+static uint64_t
+run (const int *keys, const size_t *perm, const unsigned char *ops, enum mix mix, int unicity, uint64_t *samples, size_t *nb_samples) {
+  const size_t nb = bench.nb_keys;
+  map *m = map_create (0, cmp_int, 0, unicity);
+  if (mix != INSERT) // The map is filled before the timed phase (half filled for the mixed workload).
+    for (size_t i = 0; i < (mix == MIXED ? nb / 2 : nb); i++)
+      nb_rejected += !map_insert_data (m, (void *)&keys[perm[i]]);
+  struct map_stats stats;
+  map_stats (m, &stats, 1);
+  size_t nb_balancing = map_nb_balancing (m);
+  if (bench.perf)
+    perf_start ();
+  uint64_t t0 = now_ns (), t = t0;
+  long long total = 0;
+  switch (mix) {
+    case INSERT:
+      for (size_t i = 0; i < nb; i++)
+        if (i & bench.sampling_mask)
+          nb_rejected += !map_insert_data (m, (void *)&keys[i]);
+        else {
+          t = now_ns ();
+          nb_rejected += !map_insert_data (m, (void *)&keys[i]);
+          samples[(*nb_samples)++] = now_ns () - t;
+        }
+      break;
+    case FIND:
+      for (size_t i = 0; i < nb; i++)
+        if (i & bench.sampling_mask)
+          map_find_key (m, &keys[perm[i]], MAP_EXISTS_ONE, 0, 0, 0);
+        else {
+          t = now_ns ();
+          map_find_key (m, &keys[perm[i]], MAP_EXISTS_ONE, 0, 0, 0);
+          samples[(*nb_samples)++] = now_ns () - t;
+        }
+      break;
+    case SCAN:
+      map_traverse (m, sum, &total, 0, 0);
+      samples[(*nb_samples)++] = (now_ns () - t0) / (map_size (m) ? map_size (m) : 1);
+      break;
+    case REMOVE:
+      for (size_t i = 0; i < nb; i++)
+        if (i & bench.sampling_mask)
+          map_find_key (m, &keys[perm[i]], MAP_REMOVE_ONE, 0, 0, 0);
+        else {
+          t = now_ns ();
+          map_find_key (m, &keys[perm[i]], MAP_REMOVE_ONE, 0, 0, 0);
+          samples[(*nb_samples)++] = now_ns () - t;
+        }
+      break;
+    case MIXED: // 50% finds, 25% insertions, 25% removals.
+      for (size_t i = 0; i < nb; i++) {
+        if (!(i & bench.sampling_mask))
+          t = now_ns ();
+        const int *key = &keys[perm[(i + nb / 2) % nb]];
+        if (ops[i] < 2)
+          map_find_key (m, key, MAP_EXISTS_ONE, 0, 0, 0);
+        else if (ops[i] == 2)
+          nb_rejected += !map_insert_data (m, (void *)key);
+        else
+          map_find_key (m, key, MAP_REMOVE_ONE, 0, 0, 0);
+        if (!(i & bench.sampling_mask))
+          samples[(*nb_samples)++] = now_ns () - t;
+      }
+      break;
+    default:
+      break;
+  }
+  uint64_t duration = now_ns () - t0;
+  if (bench.perf)
+    perf_stop ();
+  map_stats (m, &stats, 0);
+  nb_comparisons += stats.nb_comparisons;
+  nb_rotations += map_nb_balancing (m) - nb_balancing;
+  nb_rebuilds += stats.nb_rebuilds;
+  height = map_height (m);
+  map_destroy_all (m, 0);
+  return duration;
+}
+
+// workload runs a workload, warmup and repetitions, and prints its results in JSON.
+static int
+workload (enum keys distribution, enum mix mix, int unicity) {
+  const size_t nb = bench.nb_keys;
+  rng_state = bench.seed;
+  int *keys = malloc (nb * sizeof (*keys));
+  size_t *perm = malloc (nb * sizeof (*perm));
+  unsigned char *ops = malloc (nb);
+  uint64_t *samples = malloc ((bench.warmup + bench.repetitions) * (nb / SAMPLING + 1) * sizeof (*samples));
+  if (!keys || !perm || !ops || !samples)
+    return 0;
+  make_keys (keys, nb, distribution, &rng_state);
+  for (size_t i = 0; i < nb; i++) // A random order of access to the keys (Fisher-Yates shuffle).
+    perm[i] = i;
+  for (size_t i = nb - 1; i > 0; i--) {
+    size_t j = (size_t)(rng (&rng_state) % (i + 1)), swap = perm[i];
+    perm[i] = perm[j];
+    perm[j] = swap;
+  }
+  for (size_t i = 0; i < nb; i++)
+    ops[i] = (unsigned char)(rng (&rng_state) % 4);
+  if (bench.perf) // Counters are opened by the process of the workload, to count its own events.
+    perf_open ();
+  size_t nb_samples = 0;
+  for (size_t i = 0; i < bench.warmup; i++)
+    run (keys, perm, ops, mix, unicity, samples, &nb_samples);
+  nb_samples = nb_rejected = nb_comparisons = nb_rotations = nb_rebuilds = 0;
+  memset (counts, 0, sizeof (counts));
+  uint64_t total = 0, best = UINT64_MAX;
+  for (size_t i = 0; i < bench.repetitions; i++) {
+    uint64_t duration = run (keys, perm, ops, mix, unicity, samples, &nb_samples);
+    total += duration;
+    if (duration < best)
+      best = duration;
+  }
+  qsort (samples, nb_samples, sizeof (*samples), cmp_u64);
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("    {\"keys\": \"%s\", \"mix\": \"%s\", \"unicity\": %d, \"nb_ops\": %zu, \"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f, ",
+          KEYS[distribution], MIXES[mix], unicity, nb, (double)total / (double)bench.repetitions / (double)nb, (double)best / (double)nb);
+  if (bench.perf)
+    printf ("\"p50_ns\": null, \"p99_ns\": null, ");
+  else
+    printf ("\"p50_ns\": %llu, \"p99_ns\": %llu, ", nb_samples ? (unsigned long long)samples[nb_samples / 2] : 0ULL,
+            nb_samples ? (unsigned long long)samples[nb_samples * 99 / 100] : 0ULL);
+  printf ("\"rejected\": %zu, \"peak_rss_kib\": %ld, ", nb_rejected / bench.repetitions, usage.ru_maxrss);
+  printf ("\"comparisons_per_op\": %.2f, \"rotations_per_op\": %.3f, \"rebuilds\": %.1f, \"height\": %zu", (double)nb_comparisons / (double)bench.repetitions / (double)nb,
+          (double)nb_rotations / (double)bench.repetitions / (double)nb, (double)nb_rebuilds / (double)bench.repetitions, height);
+  if (bench.perf) {
+    printf (", \"perf\": {");
+    for (int c = 0; c < NB_COUNTERS; c++)
+      if (counter_fd[c] >= 0)
+        printf ("%s\"%s_per_op\": %.2f", c ? ", " : "", COUNTERS[c], counts[c] / (double)bench.repetitions / (double)nb);
+      else
+        printf ("%s\"%s_per_op\": null", c ? ", " : "", COUNTERS[c]);
+    printf ("}");
+  }
+  printf ("}");
+  fflush (stdout);
+  free (keys);
+  free (perm);
+  free (ops);
+  free (samples);
+  return 1;
+}
+
+int
+main (int argc, char *argv[]) {
+  int only_keys = -1, only_mix = -1;
+  for (int opt; (opt = getopt (argc, argv, "n:r:w:k:m:s:p")) != -1;)
+    switch (opt) {
+      case 'n':
+        bench.nb_keys = strtoul (optarg, 0, 10);
+        break;
+      case 'r':
+        bench.repetitions = strtoul (optarg, 0, 10);
+        break;
+      case 'w':
+        bench.warmup = strtoul (optarg, 0, 10);
+        break;
+      case 'k':
+        only_keys = lookup (optarg, KEYS, NB_KEYS);
+        break;
+      case 'm':
+        only_mix = lookup (optarg, MIXES, NB_MIXES);
+        break;
+      case 's':
+        bench.seed = strtoull (optarg, 0, 10) | 1; // xorshift needs a non-null state.
+        break;
+      case 'p':
+        bench.perf = 1;
+        bench.sampling_mask = SIZE_MAX; // Only the first operation of each repetition is timed.
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-n number of keys] [-r repetitions] [-w warmup runs] [-k keys] [-m mix] [-s seed] [-p]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  if (bench.nb_keys < 2 || !bench.repetitions) {
+    fprintf (stderr, "At least 2 keys and 1 repetition are required.\n");
+    return EXIT_FAILURE;
+  }
+  if (bench.perf) { // Checked once, to warn about unavailable counters (they are opened again by each workload.)
+    perf_open ();
+    for (int c = 0; c < NB_COUNTERS; c++)
+      if (counter_fd[c] < 0)
+        fprintf (stderr, "Counter %s not available (perf_event_open: %s).\n", COUNTERS[c], strerror (counter_errno[c]));
+      else {
+        close (counter_fd[c]);
+        counter_fd[c] = -1;
+      }
+  }
+  printf ("{\n  \"benchmark\": \"map\",\n  \"version\": \"%zu.%zu\",\n  \"nb_keys\": %zu,\n  \"repetitions\": %zu,\n  \"warmup\": %zu,\n"
+          "  \"seed\": %llu,\n  \"sampling\": %d,\n",
+          MAP_VERSION_MAJOR, MAP_VERSION_MINOR, bench.nb_keys, bench.repetitions, bench.warmup, (unsigned long long)bench.seed, bench.perf ? 0 : SAMPLING);
+#ifdef MAP_BALANCING_THRESHOLD // Defined for both the library and the benchmark (see make bench_balancing).
+  printf ("  \"balancing_threshold\": %d,\n", MAP_BALANCING_THRESHOLD);
+#endif
+  printf ("  \"results\": [\n");
+  const char *separator = "";
+  for (int k = 0; k < NB_KEYS; k++)
+    for (int m = 0; m < NB_MIXES; m++)
+      for (int unicity = 0; unicity <= 1; unicity++) {
+        if ((only_keys >= 0 && k != only_keys) || (only_mix >= 0 && m != only_mix))
+          continue;
+        printf ("%s", separator);
+        separator = ",\n";
+        fflush (stdout);
+        pid_t pid = fork (); // Each workload in its own process, for its peak memory to be measured.
+        if (!pid)
+          _exit (workload ((enum keys)k, (enum mix)m, unicity) ? EXIT_SUCCESS : EXIT_FAILURE);
+        int status;
+        if (pid < 0 || waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+          fprintf (stderr, "Workload %s/%s/%d failed.\n", KEYS[k], MIXES[m], unicity);
+          return EXIT_FAILURE;
+        }
+      }
+  printf ("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
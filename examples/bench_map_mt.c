@@ -0,0 +1,201 @@
+// (c) L. Farhi, 2024
+// Language: C (C11 or higher)
+// Benchmark of the scaling of a map shared by concurrent threads.
+// Usage: bench_map_mt [-t maximum number of threads] [-n number of keys] [-R percentage of reads] [-d duration in ms] [-k keys] [-s seed]
+// - keys: random, sorted, folded, zipf or duplicates (random by default).
+// For 1, 2, 4... up to the maximum number of threads (the number of processors by default), two workloads are run for the duration:
+// - "find_insert_remove": the threads find (reads), insert or remove (writes) elements of a single map ;
+// - "move_to": the threads move elements between two maps, with MAP_MOVE_TO inside map_transaction (both maps locked in the canonical order.)
+// For each, are reported the aggregate throughput, the fairness between threads (operations per thread and Jain's index),
+// and the rate of handoffs of the mutex of the map (from one thread to another) and of contended acquisitions.
+// Results are printed on the standard output in JSON.
+#define _DEFAULT_SOURCE // for getopt, clock_gettime, sysconf
+#include "bench_keys.c"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+enum workload { FIND_INSERT_REMOVE, MOVE_TO, NB_WORKLOADS };
+static const char *const WORKLOADS[NB_WORKLOADS] = { "find_insert_remove", "move_to" };
+
+static struct {
+  size_t nb_threads, nb_keys, read_pct, duration_ms;
+  enum keys keys;
+  uint64_t seed;
+} bench = { .nb_keys = 100 * 1000, .read_pct = 90, .duration_ms = 500, .keys = RANDOM, .seed = 1 };
+
+static int *keys;
+static map *maps[2];
+static atomic_int started, stopped;
+
+// The comparator is only called with the mutex of the map locked: it tells which thread holds the mutex, and counts the handoffs from one thread to another.
+static thread_local int self;
+static int owner;
+static size_t nb_handoffs;
+
+static int
+cmp_int_owned (const void *a, const void *b, const void *arg) {
+  if (owner != self) {
+    owner = self;
+    nb_handoffs++;
+  }
+  return cmp_int (a, b, arg);
+}
+
+struct worker {
+  thrd_t thread;
+  int id;
+  enum workload workload;
+  uint64_t state;
+  size_t nb_ops;
+};
+
+struct move {
+  map *from, *to;
+  const int *key;
+};
+
+static int
+move_one (void *arg) {
+  struct move *move = arg;
+  return (int)map_find_key (move->from, move->key, MAP_MOVE_TO, move->to, 0, 0);
+}
+
+static int
+work (void *arg) {
+  struct worker *w = arg;
+  self = w->id;
+  while (!atomic_load_explicit (&started, memory_order_acquire))
+    thrd_yield ();
+  while (!atomic_load_explicit (&stopped, memory_order_relaxed)) {
+    uint64_t r = rng (&w->state);
+    const int *key = &keys[(r >> 8) % bench.nb_keys];
+    if (w->workload == MOVE_TO) { // Odd and even threads move elements in opposite directions, without any risk of deadlock.
+      struct move move = { .from = maps[w->id % 2], .to = maps[1 - w->id % 2], .key = key };
+      map_transaction (maps, 2, move_one, &move);
+    } else if (r % 100 < bench.read_pct)
+      map_find_key (maps[0], key, MAP_EXISTS_ONE, 0, 0, 0);
+    else if (r & 0x80) {
+      if (!map_insert_data (maps[0], (void *)key)) {
+        // Never fails (no unicity constraint.)
+      }
+    } else
+      map_find_key (maps[0], key, MAP_REMOVE_ONE, 0, 0, 0);
+    w->nb_ops++;
+  }
+  return 0;
+}
+
+static int
+run (enum workload workload, size_t nb_threads, const char *separator) {
+  for (int i = 0; i < 2; i++)
+    if (!(maps[i] = map_create (0, cmp_int_owned, 0, 0)))
+      return 0;
+  for (size_t i = 0; i < bench.nb_keys; i++) // Both maps are filled for the move_to workload, the first one only otherwise.
+    if (!map_insert_data (maps[workload == MOVE_TO ? i % 2 : 0], &keys[i]))
+      return 0;
+  struct worker *workers = calloc (nb_threads, sizeof (*workers));
+  if (!workers)
+    return 0;
+  atomic_store (&started, 0);
+  atomic_store (&stopped, 0);
+  for (size_t i = 0; i < nb_threads; i++) {
+    workers[i] = (struct worker){ .id = (int)i + 1, .workload = workload, .state = ((bench.seed + i) << 1) | 1 };
+    if (thrd_create (&workers[i].thread, work, &workers[i]) != thrd_success)
+      return 0;
+  }
+  struct map_stats stats[2];
+  map_stats (maps[0], &stats[0], 1);
+  map_stats (maps[1], &stats[1], 1);
+  owner = 0;
+  nb_handoffs = 0;
+  uint64_t t0 = now_ns ();
+  atomic_store_explicit (&started, 1, memory_order_release);
+  thrd_sleep (&(struct timespec){ .tv_sec = (time_t)(bench.duration_ms / 1000), .tv_nsec = (long)(bench.duration_ms % 1000) * 1000000L }, 0);
+  atomic_store_explicit (&stopped, 1, memory_order_relaxed);
+  for (size_t i = 0; i < nb_threads; i++)
+    thrd_join (workers[i].thread, 0);
+  double seconds = (double)(now_ns () - t0) / 1e9;
+  map_stats (maps[0], &stats[0], 0);
+  map_stats (maps[1], &stats[1], 0);
+  size_t total = 0, min = SIZE_MAX, max = 0;
+  double squares = 0;
+  for (size_t i = 0; i < nb_threads; i++) {
+    total += workers[i].nb_ops;
+    squares += (double)workers[i].nb_ops * (double)workers[i].nb_ops;
+    min = workers[i].nb_ops < min ? workers[i].nb_ops : min;
+    max = workers[i].nb_ops > max ? workers[i].nb_ops : max;
+  }
+  size_t nb_contended = stats[0].nb_contended_locks + stats[1].nb_contended_locks;
+  printf ("%s    {\"workload\": \"%s\", \"keys\": \"%s\", \"threads\": %zu, \"read_pct\": %zu, \"ops\": %zu, \"ops_per_s\": %.0f, "
+          "\"ops_per_thread_min\": %zu, \"ops_per_thread_max\": %zu, \"jain_fairness\": %.3f, "
+          "\"handoffs_per_op\": %.4g, \"contended_locks_per_op\": %.4g, \"lock_wait_ns_per_op\": %.1f}",
+          separator, WORKLOADS[workload], KEYS[bench.keys], nb_threads, workload == MOVE_TO ? (size_t)0 : bench.read_pct, total, (double)total / seconds,
+          min, max, squares ? (double)total * (double)total / ((double)nb_threads * squares) : 0., total ? (double)nb_handoffs / (double)total : 0.,
+          total ? (double)nb_contended / (double)total : 0., total ? (double)(stats[0].lock_wait_ns + stats[1].lock_wait_ns) / (double)total : 0.);
+  fflush (stdout);
+  free (workers);
+  for (int i = 0; i < 2; i++)
+    map_destroy_all (maps[i], 0);
+  return 1;
+}
+
+int
+main (int argc, char *argv[]) {
+  long nb_processors = sysconf (_SC_NPROCESSORS_ONLN);
+  bench.nb_threads = nb_processors > 0 ? (size_t)nb_processors : 1;
+  for (int opt; (opt = getopt (argc, argv, "t:n:R:d:k:s:")) != -1;)
+    switch (opt) {
+      case 't':
+        bench.nb_threads = strtoul (optarg, 0, 10);
+        break;
+      case 'n':
+        bench.nb_keys = strtoul (optarg, 0, 10);
+        break;
+      case 'R':
+        bench.read_pct = strtoul (optarg, 0, 10);
+        break;
+      case 'd':
+        bench.duration_ms = strtoul (optarg, 0, 10);
+        break;
+      case 'k':
+        bench.keys = (enum keys)lookup (optarg, KEYS, NB_KEYS);
+        break;
+      case 's':
+        bench.seed = strtoull (optarg, 0, 10);
+        break;
+      default:
+        fprintf (stderr, "Usage: %s [-t maximum number of threads] [-n number of keys] [-R percentage of reads] [-d duration in ms] [-k keys] [-s seed]\n",
+                 argv[0]);
+        return EXIT_FAILURE;
+    }
+  if (bench.nb_keys < 2 || !bench.nb_threads || bench.read_pct > 100) {
+    fprintf (stderr, "At least 2 keys and 1 thread are required, and at most 100%% of reads.\n");
+    return EXIT_FAILURE;
+  }
+  uint64_t state = bench.seed | 1; // xorshift needs a non-null state.
+  if (!(keys = malloc (bench.nb_keys * sizeof (*keys))))
+    return EXIT_FAILURE;
+  make_keys (keys, bench.nb_keys, bench.keys, &state);
+  printf ("{\n  \"benchmark\": \"map_mt\",\n  \"version\": \"%zu.%zu\",\n  \"nb_keys\": %zu,\n  \"duration_ms\": %zu,\n  \"processors\": %ld,\n"
+          "  \"seed\": %llu,\n  \"results\": [\n",
+          MAP_VERSION_MAJOR, MAP_VERSION_MINOR, bench.nb_keys, bench.duration_ms, nb_processors, (unsigned long long)bench.seed);
+  const char *separator = "";
+  for (int workload = 0; workload < NB_WORKLOADS; workload++)
+    for (size_t nb_threads = 1;; nb_threads = nb_threads * 2 < bench.nb_threads ? nb_threads * 2 : bench.nb_threads) {
+      if (!run ((enum workload)workload, nb_threads, separator)) {
+        fprintf (stderr, "Workload %s with %zu threads failed.\n", WORKLOADS[workload], nb_threads);
+        return EXIT_FAILURE;
+      }
+      separator = ",\n";
+      if (nb_threads == bench.nb_threads)
+        break;
+    }
+  printf ("\n  ]\n}\n");
+  free (keys);
+  return EXIT_SUCCESS;
+}
@@ -46,15 +46,12 @@ visit_group (void *data, void *op_arg, int *remove, const void *) {
   map *grid = args->grid;
   map *current_group = args->current_group;
 
-  Point *current_point_in_grid;
   for (size_t i = 0; i < sizeof (adjacent) / sizeof (*adjacent); i++) // Breadth First Search
     for (size_t j = 0; j < 4; j++) /*NSWE*/ {
       Point delta = j == 0 ? (Point){ adjacent[i].x, adjacent[i].y } : (j == 1 ? (Point){ MINUS (adjacent[i].x), MINUS (adjacent[i].y) } : (j == 2 ? (Point){ adjacent[i].y, MINUS (adjacent[i].x) } : (Point){ MINUS (adjacent[i].y), adjacent[i].x }));
       // Find each point in the grid which is adjacent to the point in the current group (the grid is an ordered set.)
-      // Remove this point from the grid.
-      if (map_find_key (grid, &(Point){ ADD (current_point_in_group->x, delta.x), ADD (current_point_in_group->y, delta.y) }, MAP_REMOVE_ONE, &current_point_in_grid, 0, 0)) // (Complexity O(log(n)))
-        // Append it at the end of the current group (the very same group that is being traversed.)
-        assert (map_insert_data (current_group, current_point_in_grid));
+      // Move this point from the grid to the end of the current group (the very same group that is being traversed.) (Complexity O(log(n)))
+      map_find_key (grid, &(Point){ ADD (current_point_in_group->x, delta.x), ADD (current_point_in_group->y, delta.y) }, MAP_MOVE_TO, current_group, 0, 0);
     }
   return 1;
 }
@@ -74,8 +71,7 @@ grid_to_groups (map *grid, map *groups) {
 
 [[maybe_unused]] static void
 free_group (void *g) {
-  map_traverse (g, MAP_REMOVE_ALL, free, 0, 0);
-  free (g);
+  map_destroy_all (g, free);
 }
 
 //======================= display groups ================================
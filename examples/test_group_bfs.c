@@ -26,7 +26,6 @@ main (void) {
 
   map_traverse (groups, display_group, 0, 0, 0);
 
-  map_traverse (groups, MAP_REMOVE_ALL, free_group, 0, 0);
-  map_destroy (groups);
+  map_destroy_all (groups, free_group);
   map_destroy (grid);
 }
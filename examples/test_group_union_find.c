@@ -40,17 +40,26 @@ typedef struct
   Point origin, end;
 } Rectangle;
 //========================= find groups (union-find) ================================
+// The identifier of a group is shared by reference by all its points: it is the key of the points in the map.
+// When a group is merged into another one, its points are moved at once (map_merge_keys) and relabelled at once (by relabelling the group
+// and the groups previously merged into it), without any reallocation.
+typedef struct Group Group;
+struct Group
+{
+  size_t id;
+  Group *merged; // Groups previously merged into this one
+};
+
 typedef struct
 {
   Point p;
-  size_t group;
+  Group *group;
   map *owner;
-  bool to_be_removed;
 } PointInGroup;
 
 static const void *
 g_key (void *data) {
-  return &(((const PointInGroup *)data)->group);
+  return &(((const PointInGroup *)data)->group->id);
 }
 
 static int
@@ -67,73 +76,57 @@ static int
 equals_p (const void *data, void *sel_arg, const void *) {
   const PointInGroup *rg = data;
   Point *p = sel_arg;
-  return !rg->to_be_removed && rg->p.x == p->x && rg->p.y == p->y;
+  return rg->p.x == p->x && rg->p.y == p->y;
 }
 
 static int
 touches_p (const void *data, void *sel_arg, const void *) {
   const PointInGroup *rg = data;
   Point *p = sel_arg;
-  return !rg->to_be_removed && p_is_adjacent (rg->p, *p);
+  return p_is_adjacent (rg->p, *p);
 }
 
 static int
-to_be_removed (const void *data, void *sel_arg, const void *) {
-  const PointInGroup *rg = data;
-  (void)sel_arg;
-  return rg->to_be_removed;
+touching_groups (void *data, void *op_arg, int *remove, const void *) {
+  (void)remove;
+  Group **groups = op_arg; // Distinct groups, null-terminated.
+  Group *g = ((PointInGroup *)data)->group;
+  size_t i = 0;
+  while (groups[i] && groups[i]->id != g->id)
+    i++;
+  groups[i] = g;
+  return 1;
 }
 
-static int
-not_to_be_removed (const void *data, void *sel_arg, const void *context) {
-  return !to_be_removed (data, sel_arg, context);
+static Group *
+root_group (map *owner, Group *g) {
+  PointInGroup *head; // The first point of a set of groups belongs to the group into which the others were merged.
+  assert (map_find_key (owner, &g->id, MAP_GET_ONE, &head, 0, 0));
+  return head->group;
 }
 
-static int
-onlyonce_ptr_g (void *data, void *op_arg, int *remove, const void *) {
-  (void)remove;
-  PointInGroup *rg = data;
-  size_t **group = (size_t **)op_arg;
-  assert (group);
-  if (!*group)
-    *group = &rg->group;
-  else if (**group != rg->group) {
-    *group = 0;
-    return 0;
-  }
-  return 1;
-}
+typedef struct
+{
+  Group *into, *from;
+} Merge;
 
-static int
-changegroup_g (void *data, void *new_group, int *remove, const void *) {
-  PointInGroup *rg = data;
-  assert (rg->group != *(size_t *)new_group);
-  // A key MUST not be changed in place:
-  // - A new rectangle is created in the new group.
-  PointInGroup *new_r = malloc (sizeof (*new_r));
-  assert (new_r);
-  *new_r = *rg;
-  new_r->group = *(size_t *)new_group;
-  assert (map_insert_data (new_r->owner, new_r));
-  // - The rectangle in the old group is marked to be removed (changegroup_g MUST NOT remove any element.)
-  rg->to_be_removed = true;
-  (void)remove;
-  return 1;
+static void
+relabel (void *arg) {
+  Merge *merge = arg;
+  Group *last = merge->from;
+  for (Group *g = merge->from; g; g = g->merged) // Relabels all the points of 'from'.
+    (last = g)->id = merge->into->id;
+  last->merged = merge->into->merged;
+  merge->into->merged = merge->from;
 }
 
-static int
-regroup_g (void *data, void *op_arg, int *remove, const void *) {
-  (void)remove;
-  PointInGroup *rg = data;
-  size_t *ptr_g = op_arg;
-  assert (ptr_g);
-  //  All rectangles of group rg->group have to switch to group r->group:
-  // regroup_g does not remove data (with *remove = 1).
-  // Since elements MUST NOT be removed other way than with *remove = 1, changegroup_g MUST NOT remove any element.
-  size_t oldgroup = rg->group;
-  if (oldgroup != *ptr_g)
-    map_find_key (rg->owner, &oldgroup, changegroup_g, ptr_g, 0, 0);
-  return 1;
+static void
+merge_group (map *owner, Group *into, Group *from) {
+  into = root_group (owner, into);
+  from = root_group (owner, from);
+  size_t nb = map_count_key (owner, &into->id) + map_count_key (owner, &from->id);
+  assert (map_merge_keys (owner, &from->id, &into->id, relabel, &(Merge){ .into = into, .from = from }));
+  assert (map_count_key (owner, &into->id) == nb);
 }
 
 static void
@@ -144,24 +137,31 @@ add_point (map *owner, Point p) {
   if (CHECK_DUPLICATES && map_traverse (owner, MAP_EXISTS_ONE, 0, equals_p, &p))
     return;
 
-  size_t *ptr_g = 0;
-  size_t g;
-  if (!map_traverse (owner, onlyonce_ptr_g, &ptr_g, touches_p, &p))
-    g = ++group;
-  else if (ptr_g)
-    g = *ptr_g;
-  else {
-    g = ++group;
-    map_traverse (owner, regroup_g, &g, touches_p, &p);
-    map_traverse (owner, MAP_REMOVE_ALL, free, to_be_removed, 0);
+  Group *groups[9] = { 0 }; // At most 8 adjacent positions
+  map_traverse (owner, touching_groups, groups, touches_p, &p);
+  Group *g = groups[0];
+  if (!g) {
+    assert ((g = malloc (sizeof (*g))));
+    *g = (Group){ .id = ++group };
   }
+  for (size_t i = 1; groups[i]; i++)
+    merge_group (owner, g, groups[i]);
 
   PointInGroup *pg = malloc (sizeof (*pg));
   assert (pg);
-  *pg = (PointInGroup){ .p = p, .group = g, .to_be_removed = false, .owner = owner };
+  *pg = (PointInGroup){ .p = p, .group = g, .owner = owner };
   assert (map_insert_data (owner, pg));
 }
 
+static void
+collect_groups (const void *key, size_t, void *op_arg, void *) {
+  Group **all = op_arg, *g = (Group *)key; // The key is the identifier, first member of the group into which the other groups were merged.
+  while (g->merged)
+    g = g->merged;
+  g->merged = *all;
+  *all = (Group *)key;
+}
+
 //========================= display groups ================================
 [[maybe_unused]] static int
 bbox_r (void *data, void *op_arg, int *remove, const void *) {
@@ -185,7 +185,7 @@ show_point (void *data, void *op_arg, int *remove, void *) {
   (void)op_arg;
   (void)remove;
   PointInGroup *p = data;
-  printf ("%zu: {%li, %li}\n", p->group, p->p.x, p->p.y);
+  printf ("%zu: {%li, %li}\n", p->group->id, p->p.x, p->p.y);
   return 1;
 }
 
@@ -201,10 +201,10 @@ find_or_traverse (map *m, const void *key, map_operator op, void *op_arg, map_se
 display_group (const void *key, size_t, void *op_arg, void *context) {
   map *owner = op_arg;
   PointInGroup *rg;
-  if (!find_or_traverse (owner, key, MAP_GET_ONE, &rg, not_to_be_removed, 0, context) || !rg)
+  if (!find_or_traverse (owner, key, MAP_GET_ONE, &rg, 0, 0, context) || !rg)
     return;
   Rectangle bbox = (Rectangle){ rg->p, rg->p };
-  find_or_traverse (owner, key, bbox_r, &bbox, not_to_be_removed, 0, context);
+  find_or_traverse (owner, key, bbox_r, &bbox, 0, 0, context);
   printf ("(%li,%li)\n", bbox.origin.x, bbox.origin.y);
   for (long int x = bbox.origin.x; x <= bbox.end.x + 2; x++)
     printf ("-");
@@ -213,7 +213,7 @@ display_group (const void *key, size_t, void *op_arg, void *context) {
     printf ("|");
     for (long int x = bbox.origin.x; x <= bbox.end.x; x++)
       if (find_or_traverse (owner, key, MAP_GET_ONE, &rg, equals_p, &(Point){ x, y }, context))
-        printf ("%c", 'a' + (char)(rg->group % ('z' - 'a' + 1)));
+        printf ("%c", 'a' + (char)(rg->group->id % ('z' - 'a' + 1)));
       else
         printf (" ");
     printf ("|\n");
@@ -241,11 +241,16 @@ main (void) {
   printf ("%g seconds.\n", ((double)(clock () - t0)) / CLOCKS_PER_SEC);
 
   // Display results.
-  // map_traverse (RectanglesInGroups, show_point, 0, not_to_be_removed, 0);
+  // map_traverse (RectanglesInGroups, show_point, 0, 0, 0);
   display_group (0, 0, pointsInGroups, 0);
   printf ("%zu groups:\n", map_traverse_keys (pointsInGroups, 0, 0));
   map_traverse_keys (pointsInGroups, display_group, pointsInGroups);
 
-  map_traverse (pointsInGroups, MAP_REMOVE_ALL, free, 0, 0);
-  map_destroy (pointsInGroups);
+  Group *groups = 0;
+  map_traverse_keys (pointsInGroups, collect_groups, &groups);
+  map_destroy_all (pointsInGroups, free);
+  for (Group *next; groups; groups = next) {
+    next = groups->merged;
+    free (groups);
+  }
 }
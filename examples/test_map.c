@@ -1,19 +1,34 @@
 // (c) L. Farhi, 2024
 // Language: C (C11 or higher)
+#define _DEFAULT_SOURCE // for mkstemp, MAP_ANONYMOUS
 #undef NDEBUG
 #include "map.h"
 #include "trace.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <threads.h>
 #include <time.h>
 #include <unistd.h>
-#if 1
+#if defined(TRACE_HISTOGRAMS) // make CPPFLAGS="-I. -DTRACE_HISTOGRAMS" test_map: the latencies of the calls, instead of their trace and checks.
+#define map_create(...) TRACE_LATENCY (map_create (__VA_ARGS__))
+#define map_destroy(map) TRACE_LATENCY (map_destroy ((map)))
+#define map_insert_data(map, ...) TRACE_LATENCY (map_insert_data ((map), __VA_ARGS__))
+#define map_traverse(map, ...) TRACE_LATENCY (map_traverse ((map), __VA_ARGS__))
+#define map_traverse_backward(map, ...) TRACE_LATENCY (map_traverse_backward ((map), __VA_ARGS__))
+#define map_find_key(map, ...) TRACE_LATENCY (map_find_key ((map), __VA_ARGS__))
+#define map_size(map) TRACE_LATENCY (map_size ((map)))
+#elif 1
 #define map_create(...) TRACE_EXPRESSION (map_check (map_create (__VA_ARGS__)))
 #define map_destroy(map) TRACE_EXPRESSION (map_destroy (map_check ((map))))
 #define map_insert_data(map, ...) TRACE_EXPRESSION (map_insert_data (map_check ((map)), __VA_ARGS__))
@@ -437,6 +452,7 @@ test5 (void) {
 #undef map_insert_data
 #undef map_traverse
 #undef map_traverse_backward
+#undef map_find_key
 #undef map_size
 #undef map_height
 // #define map_display(map, ...) do { if (map_size (map) <= 64) map_display (map, __VA_ARGS__);} while (0)
@@ -556,6 +572,758 @@ test6 (void) {
     }
 }
 
+static int
+move_all (void *arg) {
+  map **from_to = arg;
+  map_traverse (from_to[0], MAP_MOVE_TO, from_to[1], 0, 0);
+  return 1;
+}
+
+static int
+move_forth_and_back (void *arg) {
+  map **from_to = arg;
+  for (size_t i = 0; i < 1000; i++)
+    map_transaction (from_to, 2, move_all, from_to); // The maps are locked in the same order by both threads.
+  return 0;
+}
+
+static void
+test7 (void) {
+  static const size_t NB = 1000;
+  puts ("============================================================");
+  map *a = map_create (0, cmpip, 0, 0);
+  map *b = map_create (0, 0, 0, 0);
+  for (size_t i = 0; i < NB; i++) {
+    int *pi = malloc (sizeof (*pi));
+    *pi = rand () % (int)NB;
+    assert (map_insert_data (i % 2 ? a : b, pi));
+  }
+  thrd_t t1, t2;
+  assert (thrd_create (&t1, move_forth_and_back, (map *[]){ a, b }) == thrd_success);
+  assert (thrd_create (&t2, move_forth_and_back, (map *[]){ b, a }) == thrd_success);
+  thrd_join (t1, 0);
+  thrd_join (t2, 0);
+  fprintf (stdout, "%'zu + %'zu elements.\n", map_size (a), map_size (b));
+  assert (map_size (a) + map_size (b) == NB);
+  struct map_stats stats;
+  assert (map_stats (a, &stats, 1));
+  fprintf (stdout, "Map a: %'zu locks, %'zu contended (%'llu us waiting), %'zu comparisons, %'zu bytes of overhead, %'zu equal keys at most.\n", stats.nb_locks,
+           stats.nb_contended_locks, stats.lock_wait_ns / 1000, stats.nb_comparisons, stats.overhead, stats.max_equal_keys);
+  assert (stats.nb_insertions == NB / 2 && stats.nb_allocations == NB / 2 && stats.nb_traversals >= 1000);
+  assert (map_stats (a, &stats, 0) && !stats.nb_insertions && stats.nb_locks == 1); // Reset.
+#ifdef MAP_LOCK_PROFILING // make CPPFLAGS=-DMAP_LOCK_PROFILING defines it for the library too.
+  assert (map_lock_profile (a, stdout, 0));
+#endif
+  map_traverse (a, MAP_REMOVE_ALL, free, 0, 0);
+  map_traverse (b, MAP_REMOVE_ALL, free, 0, 0);
+  map_destroy (a);
+  map_destroy (b);
+}
+
+static void
+test8 (void) {
+  static const size_t NB = 100 * 1000;
+  static const size_t NB_FINDS = 1000 * 1000;
+  puts ("============================================================");
+  // Zipf distribution of ranks (s = 1): rank r is drawn with a probability proportional to 1/r.
+  double *cdf = malloc (NB * sizeof (*cdf));
+  int *keys = malloc (NB * sizeof (*keys));
+  size_t *draws = malloc (NB_FINDS * sizeof (*draws));
+  assert (cdf && keys && draws);
+  double sum = 0;
+  for (size_t r = 0; r < NB; r++) {
+    cdf[r] = (sum += 1. / (double)(r + 1));
+    keys[r] = (int)r;
+  }
+  for (size_t r = NB - 1; r > 0; r--) { // Hot keys are spread over the whole range of keys.
+    size_t i = (size_t)rand () % (r + 1);
+    int k = keys[r];
+    keys[r] = keys[i];
+    keys[i] = k;
+  }
+  for (size_t i = 0; i < NB_FINDS; i++) {
+    double u = sum * rand () / ((double)RAND_MAX + 1);
+    size_t lo = 0, hi = NB - 1;
+    while (lo < hi)
+      if (cdf[(lo + hi) / 2] < u)
+        lo = (lo + hi) / 2 + 1;
+      else
+        hi = (lo + hi) / 2;
+    draws[i] = lo;
+  }
+  for (int splaying = 0; splaying <= 1; splaying++) {
+    map *ints = map_create (0, cmpip, 0, 1);
+    map_set_splaying (ints, splaying);
+    for (size_t i = 0; i < NB; i++)
+      assert (map_insert_data (ints, &keys[i]));
+    size_t nb_balancing = map_nb_balancing (ints), height = map_height (ints);
+    struct map_stats stats;
+    assert (map_stats (ints, &stats, 1));
+    for (size_t i = 0; i < NB_FINDS; i++)
+      assert (map_find_key (ints, &keys[draws[i]], 0, 0, 0, 0) == 1);
+    assert (map_stats (ints, &stats, 0) && stats.nb_finds == NB_FINDS);
+    if (!splaying) // Finds leave a balanced tree untouched.
+      assert (map_nb_balancing (ints) == nb_balancing && map_height (ints) == height);
+    fprintf (stdout, "%'zu Zipf finds among %'zu elements (%s), %.1f comparisons per find, height %zu [%'zu].\n", NB_FINDS, NB,
+             splaying ? "splaying" : "balanced", (double)stats.nb_comparisons / (double)NB_FINDS, map_height (ints), map_nb_balancing (ints) - nb_balancing);
+    size_t previous = SIZE_MAX;
+    for (size_t i = 0; i < 8; i++) { // A key found over and over again costs as many comparisons each time in a balanced tree...
+      assert (map_stats (ints, &stats, 1) && map_find_key (ints, &keys[NB - 1], 0, 0, 0, 0) == 1 && map_stats (ints, &stats, 0));
+      assert (splaying ? stats.nb_comparisons <= previous : previous == SIZE_MAX || stats.nb_comparisons == previous);
+      previous = stats.nb_comparisons;
+    }
+    assert (!splaying || previous == 1); // ... is moved up to the root by splaying.
+    if (splaying) { // Splaying switched off, the tree respects the balancing criterion again.
+      size_t log2 = 0;
+      for (size_t n = NB + 2; n >>= 1;)
+        log2++;
+      assert (map_stats (ints, &stats, 1) && map_set_splaying (ints, 0) && map_height (ints) * 100 <= 145 * (log2 + 1)); // The height of an AVL tree is less than 1.45 log2 (n + 2).
+      assert (map_stats (ints, &stats, 0) && stats.nb_rebuilds == 1);
+      (map_display) (ints, 0, 0); // map_check, on every node.
+      fprintf (stdout, "Splaying switched off, height %zu.\n", map_height (ints));
+    }
+    map_traverse (ints, MAP_REMOVE_ALL, 0, 0, 0);
+    map_destroy (ints);
+  }
+  free (draws);
+  free (keys);
+  free (cdf);
+}
+
+static size_t
+serialize_int (const void *data, const void **bytes) {
+  *bytes = data; // An int is its own serialized form.
+  return sizeof (int);
+}
+
+static void *
+deserialize_int (const void *bytes, size_t size) {
+  int *pi = malloc (sizeof (*pi));
+  assert (pi && size == sizeof (*pi));
+  memcpy (pi, bytes, size);
+  return pi;
+}
+
+static int
+copy_to_next (void *data, void *op_arg, int *, const void *) {
+  int **next = op_arg;
+  *(*next)++ = *(int *)data;
+  return 1;
+}
+
+static int
+compare_with_next (void *data, void *op_arg, int *, const void *) {
+  int **next = op_arg;
+  assert (**next == *(int *)data); // Same order, same values.
+  (*next)++;
+  return 1;
+}
+
+static void
+test9 (void) {
+  static const size_t NB = 10 * 1000;
+  puts ("============================================================");
+  map *ints = map_create (0, cmpip, 0, 0);
+  int *values = malloc (NB * sizeof (*values));
+  assert (values);
+  for (size_t i = 0; i < NB; i++) {
+    values[i] = rand () % (int)(NB / 4); // With duplicates
+    assert (map_insert_data (ints, &values[i]));
+  }
+  char path[] = "/tmp/test_map_XXXXXX";
+  int fd = mkstemp (path);
+  assert (fd >= 0);
+  assert (map_dump (ints, fd, serialize_int) == NB);
+  close (fd);
+  int *sorted = malloc (NB * sizeof (*sorted)), *next = sorted;
+  assert (sorted);
+  map_traverse (ints, copy_to_next, &next, 0, 0);
+  map_traverse (ints, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (ints);
+  free (values);
+
+  for (int zero_copy = 0; zero_copy <= 1; zero_copy++) {
+    ints = map_create (0, cmpip, 0, 0);
+    assert (map_load_mmap (ints, path, zero_copy ? 0 : deserialize_int) == NB);
+    assert (map_size (ints) == NB);
+    next = sorted;
+    map_traverse (ints, compare_with_next, &next, 0, 0);
+    for (size_t i = 0; i < NB; i++)
+      assert (map_find_key (ints, &sorted[i], 0, 0, 0, 0) == map_count_key (ints, &sorted[i]) && map_count_key (ints, &sorted[i]));
+    fprintf (stdout, "%'zu elements reloaded (%s), height %zu.\n", map_size (ints), zero_copy ? "zero-copy" : "deserialized", map_height (ints));
+    if (zero_copy) // Checkpoint the map over the very file it is mapped from.
+      assert (map_checkpoint (ints, path, serialize_int));
+    map_traverse (ints, MAP_REMOVE_ALL, zero_copy ? 0 : free, 0, 0);
+    map_destroy (ints);
+  }
+  ints = map_create (0, cmpip, 0, 0);
+  assert (map_load_mmap (ints, path, 0) == NB);
+  next = sorted;
+  map_traverse (ints, compare_with_next, &next, 0, 0);
+  map_traverse (ints, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (ints);
+  free (sorted);
+  unlink (path);
+}
+
+static int
+insert_journaled (void *arg) {
+  for (size_t i = 0; i < 100; i++) {
+    int *pi = malloc (sizeof (*pi));
+    assert (pi);
+    *pi = rand () % 1000;
+    assert (map_insert_data (arg, pi)); // Durable on return.
+  }
+  return 0;
+}
+
+static int
+remove_journaled (void *arg) {
+  for (void *data = 0; map_traverse (arg, MAP_REMOVE_ONE, &data, 0, 0); data = 0)
+    free (data); // Durably removed on return.
+  return 0;
+}
+
+static int
+is_odd (const void *data, void *sel_arg, const void *context) {
+  (void)sel_arg;
+  (void)context;
+  return *(const int *)data % 2;
+}
+
+static void
+test10 (void) {
+  static const size_t NB_THREADS = 10;
+  puts ("============================================================");
+  char checkpoint[] = "/tmp/test_map_XXXXXX", journal[] = "/tmp/test_map_journal_XXXXXX";
+  close (mkstemp (checkpoint));
+  int fd = mkstemp (journal);
+  assert (fd >= 0);
+  map *ints = map_create (0, cmpip, 0, 0);
+  assert (map_set_journal (ints, fd, serialize_int));
+  for (int phase = 0; phase < 2; phase++) {
+    thrd_t threads[NB_THREADS];
+    struct timespec ts0, ts;
+    timespec_get (&ts0, TIME_UTC);
+    for (size_t i = 0; i < NB_THREADS; i++)
+      assert (thrd_create (&threads[i], insert_journaled, ints) == thrd_success);
+    for (size_t i = 0; i < NB_THREADS; i++)
+      thrd_join (threads[i], 0);
+    timespec_get (&ts, TIME_UTC);
+    fprintf (stdout, "[%'.Lf ms] %'zu durable insertions by %zu threads.\n",
+             1000.L * difftime (ts.tv_sec, ts0.tv_sec) + (ts.tv_nsec - ts0.tv_nsec) / 1000000.L, 100 * NB_THREADS, NB_THREADS);
+    if (!phase)
+      assert (map_checkpoint (ints, checkpoint, serialize_int)); // The journal restarts empty.
+  }
+  map_traverse (ints, MAP_REMOVE_ALL, free, is_odd, 0); // Removals are journaled, although data are free'd by the operator.
+  int *sorted = malloc (map_size (ints) * sizeof (*sorted)), *next = sorted;
+  assert (sorted);
+  map_traverse (ints, copy_to_next, &next, 0, 0);
+
+  // Recovery: the last checkpoint, and the journal replayed on top of it.
+  map *recovered = map_create (0, cmpip, 0, 0);
+  assert (map_load_mmap (recovered, checkpoint, deserialize_int) == 100 * NB_THREADS);
+  assert (map_replay_journal (recovered, journal, serialize_int, deserialize_int, free));
+  fprintf (stdout, "%'zu elements recovered from a checkpoint and a journal.\n", map_size (recovered));
+  assert (map_size (recovered) == map_size (ints));
+  next = sorted;
+  map_traverse (recovered, compare_with_next, &next, 0, 0);
+  free (sorted);
+  assert (map_destroy_all (recovered, free));
+
+  // The removal of all the elements is journaled as a single record.
+  size_t nb = map_size (ints);
+  assert (map_clear (ints, free) == nb && !map_size (ints));
+  insert_journaled (ints);
+  recovered = map_create (0, cmpip, 0, 0);
+  assert (map_load_mmap (recovered, checkpoint, deserialize_int) == 100 * NB_THREADS);
+  assert (map_replay_journal (recovered, journal, serialize_int, deserialize_int, free));
+  assert (map_size (recovered) == map_size (ints) && map_size (ints) == 100);
+  assert ((sorted = malloc (map_size (ints) * sizeof (*sorted))));
+  next = sorted;
+  map_traverse (ints, copy_to_next, &next, 0, 0);
+  next = sorted;
+  map_traverse (recovered, compare_with_next, &next, 0, 0);
+  free (sorted);
+  assert (map_destroy_all (recovered, free));
+
+  // A checkpoint written while other threads journal their insertions: those are replayed on top of it.
+  thrd_t threads[NB_THREADS];
+  for (size_t i = 0; i < NB_THREADS; i++)
+    assert (thrd_create (&threads[i], insert_journaled, ints) == thrd_success);
+  assert (map_checkpoint (ints, checkpoint, serialize_int));
+  for (size_t i = 0; i < NB_THREADS; i++)
+    thrd_join (threads[i], 0);
+  for (int idle = 0; idle <= 1; idle++) {
+    recovered = map_create (0, cmpip, 0, 0);
+    assert (map_load_mmap (recovered, checkpoint, deserialize_int) >= 100);
+    size_t nb_replayed = map_replay_journal (recovered, journal, serialize_int, deserialize_int, free);
+    assert (!idle || !nb_replayed); // A checkpoint of an idle map empties the journal.
+    fprintf (stdout, "%'zu elements recovered from a checkpoint and %'zu journaled modifications.\n", map_size (recovered), nb_replayed);
+    assert (map_size (recovered) == map_size (ints) && map_size (ints) == 100 * (NB_THREADS + 1));
+    assert ((sorted = malloc (map_size (ints) * sizeof (*sorted))));
+    next = sorted;
+    map_traverse (ints, copy_to_next, &next, 0, 0);
+    next = sorted;
+    map_traverse (recovered, compare_with_next, &next, 0, 0);
+    free (sorted);
+    assert (map_destroy_all (recovered, free));
+    if (!idle)
+      assert (map_checkpoint (ints, checkpoint, serialize_int));
+  }
+  // A checkpoint written while another thread removes and frees the elements: the removed data are not serialized once free'd.
+  thrd_t remover;
+  assert (thrd_create (&remover, remove_journaled, ints) == thrd_success);
+  assert (map_checkpoint (ints, checkpoint, serialize_int));
+  thrd_join (remover, 0);
+  recovered = map_create (0, cmpip, 0, 0);
+  map_load_mmap (recovered, checkpoint, deserialize_int);
+  map_replay_journal (recovered, journal, serialize_int, deserialize_int, free);
+  assert (!map_size (ints) && !map_size (recovered));
+  assert (map_destroy_all (recovered, free));
+  assert (map_destroy_all (ints, free));
+  close (fd);
+  unlink (checkpoint);
+
+  // A journal torn by an interruption goes on after its last complete record.
+  assert ((fd = open (journal, O_RDWR | O_TRUNC)) >= 0); // Without O_APPEND.
+  ints = map_create (0, cmpip, 0, 0);
+  assert (map_set_journal (ints, fd, serialize_int));
+  for (int i = 1; i <= 3; i++) {
+    int *pi = malloc (sizeof (*pi));
+    assert (pi && (*pi = i) && map_insert_data (ints, pi));
+  }
+  struct stat st;
+  assert (!fstat (fd, &st));
+  assert (map_destroy_all (ints, free));
+  assert (!ftruncate (fd, st.st_size - 8)); // The record of the third insertion is torn.
+  ints = map_create (0, cmpip, 0, 0);
+  assert (map_replay_journal (ints, journal, serialize_int, deserialize_int, free) == 2);
+  assert (map_set_journal (ints, fd, serialize_int));
+  for (int i = 10; i <= 12; i++) {
+    int *pi = malloc (sizeof (*pi));
+    assert (pi && (*pi = i) && map_insert_data (ints, pi));
+  }
+  recovered = map_create (0, cmpip, 0, 0);
+  assert (map_replay_journal (recovered, journal, serialize_int, deserialize_int, free) == 5);
+  int expected[] = { 1, 2, 10, 11, 12 };
+  next = expected;
+  assert (map_traverse (recovered, compare_with_next, &next, 0, 0) == 5 && next == expected + 5);
+  assert (map_destroy_all (recovered, free));
+  assert (map_destroy_all (ints, free));
+  close (fd);
+  unlink (journal);
+}
+
+struct event {
+  int date, id;
+};
+
+static const void *
+get_date (void *data) {
+  return &((struct event *)data)->date;
+}
+
+static int
+cmp_id (const void *a, const void *b, const void *arg) {
+  (void)arg;
+  return cmpip (&((const struct event *)a)->id, &((const struct event *)b)->id, 0);
+}
+
+static int
+check_event_order (void *data, void *op_arg, int *, const void *) {
+  struct event **previous = op_arg;
+  struct event *e = data;
+  assert (!*previous || (*previous)->date < e->date || ((*previous)->date == e->date && (*previous)->id <= e->id));
+  *previous = e;
+  return 1;
+}
+
+static void
+check_day (const void *key, size_t nb_entries, void *op_arg, void *context) {
+  (void)context;
+  assert (nb_entries == map_count_key (op_arg, key) && nb_entries == map_find_key (op_arg, key, 0, 0, 0, 0));
+}
+
+static void
+test11 (void) {
+  static const int NB = 100 * 1000, NB_DAYS = 10;
+  puts ("============================================================");
+  struct event *events = malloc ((size_t)NB * sizeof (*events));
+  assert (events);
+  map *calendar = map_create (get_date, cmpip, 0, 0);
+  assert (map_set_secondary_comparator (calendar, cmp_id, 0));
+  for (int i = 0; i < NB; i++) {
+    events[i] = (struct event){ .date = rand () % NB_DAYS, .id = rand () % (NB / 2) }; // About 10,000 events a day, a few with the same identifier.
+    assert (map_insert_data (calendar, &events[i]));
+  }
+  errno = 0;
+  assert (!map_set_secondary_comparator (calendar, cmp_id, 0) && errno == EPERM); // Not empty.
+  (map_display) (calendar, 0, 0); // map_check, on the whole map.
+  struct event *previous = 0;
+  map_traverse (calendar, check_event_order, &previous, 0, 0);
+  assert (map_traverse_keys (calendar, check_day, calendar) <= (size_t)NB_DAYS);
+  for (int i = 0; i < NB; i += NB / 100) {
+    size_t nb = map_count_key (calendar, &events[i].date);
+    struct map_stats stats;
+    map_stats (calendar, &stats, 1);
+    size_t nb_equal = map_find_data (calendar, &events[i], 0, 0);
+    map_stats (calendar, &stats, 0);
+    assert (nb_equal >= 1 && stats.nb_comparisons < 64); // In log n, not in the number of events of the day.
+    struct event *removed = 0;
+    assert (map_find_data (calendar, &events[i], MAP_REMOVE_ONE, &removed) == 1 && removed && !cmp_id (removed, &events[i], 0) && removed->date == events[i].date);
+    assert (map_count_key (calendar, &events[i].date) == nb - 1);
+    assert (map_find_data (calendar, &events[i], 0, 0) == nb_equal - 1);
+    assert (map_insert_data (calendar, removed));
+  }
+  (map_display) (calendar, 0, 0);
+  int day = 3;
+  size_t nb = map_count_key (calendar, &day);
+  assert (map_find_key (calendar, &day, MAP_REMOVE_ALL, 0, 0, 0) == nb && !map_count_key (calendar, &day));
+  (map_display) (calendar, 0, 0);
+  assert (map_size (calendar) == (size_t)NB - nb);
+  fprintf (stdout, "%'zu events (%'zu removed on day %i), height %zu.\n", map_size (calendar), nb, day, map_height (calendar));
+  map_traverse (calendar, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (calendar);
+  free (events);
+}
+
+static int
+postpone (void *data, void *op_arg, int *remove, const void *) {
+  if (*remove == MAP_REKEY) // The change was refused: the former key is restored.
+    ((struct event *)data)->date -= *(int *)op_arg;
+  else {
+    ((struct event *)data)->date += *(int *)op_arg; // The key is changed in place.
+    *remove = MAP_REKEY;
+  }
+  return 1;
+}
+
+static int
+postpone_and_insert (void *data, void *op_arg, int *remove, const void *context) {
+  postpone (data, &(int){ 1 }, remove, context);
+  errno = 0;
+  assert (!map_insert_data ((map *)context, op_arg) && errno == EPERM);
+  return 1;
+}
+
+static int
+postpone_next_day (void *data, void *op_arg, int *remove, const void *context) {
+  (void)remove;
+  ++*(size_t *)op_arg;
+  if (((struct event *)data)->date == 0) // The event of the next day is postponed by a nested find, while it has not been traversed yet.
+    assert (map_find_key ((map *)context, &(int){ 1 }, postpone, &(int){ 100 }, 0, 0) == 1);
+  return 1;
+}
+
+static int
+check_date_order (void *data, void *op_arg, int *, const void *) {
+  struct event **previous = op_arg;
+  assert (!*previous || (*previous)->date <= ((struct event *)data)->date);
+  *previous = data;
+  return 1;
+}
+
+static void
+test12 (void) {
+  static const int NB = 10 * 1000, NB_DAYS = 10;
+  puts ("============================================================");
+  struct event *events = malloc ((size_t)NB * sizeof (*events));
+  map *calendar = map_create (get_date, cmpip, 0, 0);
+  assert (events && calendar);
+  for (int i = 0; i < NB; i++) {
+    events[i] = (struct event){ .date = rand () % NB_DAYS, .id = i };
+    assert (map_insert_data (calendar, &events[i]));
+  }
+  // Every event is postponed by one day, once, while traversing.
+  assert (map_traverse (calendar, postpone, &(int){ 1 }, 0, 0) == (size_t)NB && map_size (calendar) == (size_t)NB);
+  (map_display) (calendar, 0, 0);
+  assert (!map_count_key (calendar, &(int){ 0 }));
+  struct event *previous = 0;
+  map_traverse (calendar, check_date_order, &previous, 0, 0);
+  // The events of a day are postponed by two days.
+  int day = 3, later = 5;
+  size_t nb = map_count_key (calendar, &day), nb_later = map_count_key (calendar, &later);
+  assert (map_find_key (calendar, &day, postpone, &(int){ later - day }, 0, 0) == nb);
+  (map_display) (calendar, 0, 0);
+  assert (!map_count_key (calendar, &day) && map_count_key (calendar, &later) == nb + nb_later && map_size (calendar) == (size_t)NB);
+  map_traverse (calendar, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (calendar);
+
+  // An element postponed by a nested find is relinked at the end of the outermost traversal, and is not traversed twice.
+  calendar = map_create (get_date, cmpip, 0, 0);
+  assert (calendar);
+  for (int i = 0; i < NB_DAYS; i++) {
+    events[i] = (struct event){ .date = i, .id = i };
+    assert (map_insert_data (calendar, &events[i]));
+  }
+  size_t nb_traversed = 0;
+  assert (map_traverse (calendar, postpone_next_day, &nb_traversed, 0, 0) == (size_t)NB_DAYS - 1 && nb_traversed == (size_t)NB_DAYS - 1);
+  assert (map_count_key (calendar, &(int){ 101 }) == 1 && map_size (calendar) == (size_t)NB_DAYS);
+  map_traverse (calendar, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (calendar);
+
+  // With unicity constraint, an element can not be moved to a key already in the map: the operator restores the former key.
+  calendar = map_create (get_date, cmpip, 0, 1);
+  assert (calendar && map_insert_data (calendar, &(struct event){ .date = 1 }) && map_insert_data (calendar, &(struct event){ .date = 2 }));
+  assert (map_find_key (calendar, &(int){ 2 }, postpone, &(int){ 1 }, 0, 0) == 1 && map_size (calendar) == 2 && map_count_key (calendar, &(int){ 3 }));
+  errno = 0;
+  assert (map_find_key (calendar, &(int){ 1 }, postpone, &(int){ 2 }, 0, 0) == 1 && errno == EPERM && map_size (calendar) == 2);
+  assert (map_count_key (calendar, &(int){ 1 }) == 1 && map_count_key (calendar, &(int){ 3 }) == 1);
+  errno = 0;
+  assert (map_traverse (calendar, postpone, &(int){ 2 }, 0, 0) == 2 && errno == EPERM && map_size (calendar) == 2);
+  assert (map_count_key (calendar, &(int){ 1 }) == 1 && map_count_key (calendar, &(int){ 5 }) == 1);
+  // The new key is taken as soon as it is changed, although the element is relinked later.
+  assert (map_find_key (calendar, &(int){ 5 }, postpone_and_insert, &(struct event){ .date = 6 }, 0, 0) == 1 && map_size (calendar) == 2);
+  assert (map_count_key (calendar, &(int){ 6 }) == 1);
+  (map_display) (calendar, 0, 0);
+  map_traverse (calendar, MAP_REMOVE_ALL, 0, 0, 0);
+  map_destroy (calendar);
+  fprintf (stdout, "%'zu events postponed.\n", (size_t)NB);
+  free (events);
+}
+
+static const size_t NB_RECLAIMED = 1000 * 1000;
+static atomic_size_t nb_cleared, nb_destroyed;
+static mtx_t reclaimed_mutex;
+static cnd_t reclaimed_condition;
+
+static void
+free_cleared (void *data) {
+  free (data);
+  atomic_fetch_add (&nb_cleared, 1);
+}
+
+static void
+free_destroyed (void *data) {
+  assert (atomic_load (&nb_cleared) == NB_RECLAIMED); // Reclamations are processed in order.
+  free (data);
+  mtx_lock (&reclaimed_mutex);
+  if (atomic_fetch_add (&nb_destroyed, 1) + 1 == NB_RECLAIMED)
+    cnd_signal (&reclaimed_condition);
+  mtx_unlock (&reclaimed_mutex);
+}
+
+static void
+test13 (void) {
+  const size_t NB = NB_RECLAIMED;
+  puts ("============================================================");
+  assert (mtx_init (&reclaimed_mutex, mtx_plain) == thrd_success && cnd_init (&reclaimed_condition) == thrd_success);
+  map *ints = map_create (0, cmpip, 0, 0);
+  assert (ints);
+  for (size_t i = 0; i < 2 * NB; i++) {
+    int *pi = malloc (sizeof (*pi));
+    assert (pi);
+    *pi = rand ();
+    assert (map_insert_data (ints, pi));
+    if (i == NB - 1) {
+      assert (map_clear_async (ints, free_cleared) == NB && !map_size (ints)); // The map is reusable at once.
+      fprintf (stdout, "%'zu elements cleared in the background.\n", NB);
+    }
+  }
+  assert (map_size (ints) == NB);
+  assert (map_destroy_async (ints, free_destroyed)); // The map is destroyed at once.
+  mtx_lock (&reclaimed_mutex);
+  while (atomic_load (&nb_destroyed) < NB)
+    cnd_wait (&reclaimed_condition, &reclaimed_mutex);
+  mtx_unlock (&reclaimed_mutex);
+  assert (atomic_load (&nb_cleared) == NB && atomic_load (&nb_destroyed) == NB);
+  fprintf (stdout, "%'zu elements deallocated in the background.\n", atomic_load (&nb_cleared) + atomic_load (&nb_destroyed));
+  cnd_destroy (&reclaimed_condition);
+  mtx_destroy (&reclaimed_mutex);
+}
+
+static void
+test14 (void) {
+  puts ("============================================================");
+  // Elements moved by MAP_MOVE_TO from a map with a secondary comparator into a map with unicity constraint, which already holds their key.
+  struct event events[] = { { .date = 3, .id = 1 }, { .date = 3, .id = 1 }, { .date = 3, .id = 2 }, { .date = 4, .id = 1 } }, other = { .date = 3 };
+  map *calendar = map_create (get_date, cmpip, 0, 0), *days = map_create (get_date, cmpip, 0, 1);
+  assert (calendar && days && map_set_secondary_comparator (calendar, cmp_id, 0));
+  for (size_t i = 0; i < sizeof (events) / sizeof (*events); i++)
+    assert (map_insert_data (calendar, &events[i]));
+  assert (map_insert_data (days, &other));
+  int day = 3;
+  assert (map_find_key (calendar, &day, MAP_MOVE_TO, days, 0, 0) == 3); // All the events of the day are found, none is moved.
+  assert (map_size (calendar) == 4 && map_count_key (calendar, &day) == 3 && map_size (days) == 1);
+  (map_display) (calendar, 0, 0);
+  struct event *removed = 0;
+  assert (map_find_key (days, &day, MAP_REMOVE_ONE, &removed, 0, 0) == 1 && removed == &other);
+  assert (map_find_key (calendar, &day, MAP_MOVE_TO, days, 0, 0) == 3); // Only the first event of the day is moved.
+  assert (map_count_key (calendar, &day) == 2 && map_size (days) == 1);
+  (map_display) (calendar, 0, 0);
+  assert (map_destroy_all (calendar, 0) && map_destroy_all (days, 0));
+  fprintf (stdout, "Events not moved are still found.\n");
+}
+
+static void
+test15 (void) {
+  static const int NB = 1000;
+  puts ("============================================================");
+  map *ints = map_create (0, cmpip, 0, 0);
+  for (int i = 0; i < NB; i++) {
+    int *pi = malloc (sizeof (*pi));
+    assert (pi);
+    *pi = rand () % (NB / 4); // With duplicates
+    assert (map_insert_data (ints, pi));
+  }
+  map *snapshot = map_snapshot (ints);
+  assert (snapshot);
+  (map_display) (snapshot, 0, 0);
+  assert (map_size (snapshot) == map_size (ints));
+  for (int i = 0; i < NB / 4; i++)
+    assert (map_find_key (snapshot, &i, 0, 0, 0, 0) == map_find_key (ints, &i, 0, 0, 0, 0) && map_count_key (snapshot, &i) == map_count_key (ints, &i) &&
+            map_count_key (ints, &i) == map_find_key (ints, &i, 0, 0, 0, 0));
+  int *sorted = malloc ((size_t)NB * sizeof (*sorted)), *next = sorted;
+  assert (sorted);
+  map_traverse (snapshot, copy_to_next, &next, 0, 0);
+  map_traverse (ints, MAP_REMOVE_ALL, 0, select_random, 0); // The snapshot is unchanged.
+  next = sorted;
+  map_traverse (snapshot, compare_with_next, &next, 0, 0);
+  assert (next == sorted + NB);
+
+  // A snapshot of a map loaded in place from a file.
+  char path[] = "/tmp/test_map_XXXXXX";
+  int fd = mkstemp (path);
+  assert (fd >= 0);
+  assert (map_dump (snapshot, fd, serialize_int) == (size_t)NB);
+  close (fd);
+  assert (map_destroy_all (ints, 0));
+  assert (map_destroy_all (snapshot, free)); // The data are shared by the map and its snapshot.
+  map *loaded = map_create (0, cmpip, 0, 0);
+  assert (map_load_mmap (loaded, path, 0) == (size_t)NB);
+  unlink (path);
+  assert ((snapshot = map_snapshot (loaded)));
+  assert (map_destroy_all (loaded, free)); // Data used in place are not free'd, and remain mapped for the snapshot.
+  next = sorted;
+  map_traverse (snapshot, compare_with_next, &next, 0, 0);
+  assert (next == sorted + NB);
+  assert (map_destroy_all (snapshot, free)); // The file is unmapped with the last map referring to it.
+  free (sorted);
+  fprintf (stdout, "%i elements unchanged in the snapshots.\n", NB);
+}
+
+static int
+select_middle (const void *data, void *sel_arg, const void *) {
+  int id = ((const struct event *)data)->id;
+  return id != 0 && id != *(int *)sel_arg - 1; // Neither the first nor the last of the equal elements.
+}
+
+static int
+remove_head_on_the_way (void *data, void *op_arg, int *remove, const void *context) {
+  struct event *e = data;
+  if (e->id == *(int *)op_arg / 2) { // The head of the equal elements is removed by a nested find, in the middle of the traversal.
+    struct event *head = 0;
+    assert (map_find_key ((map *)context, &e->date, MAP_REMOVE_ONE, &head, 0, 0) == 1 && head && head->id == 0);
+  }
+  *remove = 1;
+  return 1;
+}
+
+static void
+test16 (void) {
+  static const int NB = 100 * 1000;
+  puts ("============================================================");
+  struct event *events = malloc ((size_t)NB * sizeof (*events));
+  map *calendar = map_create (get_date, cmpip, 0, 0);
+  assert (events && calendar);
+  for (int pass = 0; pass < 4; pass++) {
+    for (int i = 0; i < NB; i++) {
+      events[i] = (struct event){ .date = 0, .id = i }; // All on the same day, in the order of their ids.
+      assert (map_insert_data (calendar, &events[i]));
+    }
+    int day = 0;
+    size_t nb = (size_t)NB - 2;
+    if (pass == 0) // The middle elements are removed from the tail up (each in constant time, without walking up to the head.)
+      assert (map_traverse_backward (calendar, MAP_REMOVE_ALL, 0, select_middle, (void *)&NB) == nb);
+    else if (pass == 1) // ... from the head down,
+      assert (map_traverse (calendar, MAP_REMOVE_ALL, 0, select_middle, (void *)&NB) == nb);
+    else if (pass == 2) // ... by a find,
+      assert (map_find_key (calendar, &day, MAP_REMOVE_ALL, 0, select_middle, (void *)&NB) == nb);
+    else { // ... and while the head is removed by a nested call.
+      assert (map_traverse (calendar, remove_head_on_the_way, (void *)&NB, select_middle, (void *)&NB) == nb);
+      nb++;
+    }
+    (map_display) (calendar, 0, 0); // map_check: the count of equal elements is checked.
+    assert (map_count_key (calendar, &day) == (size_t)NB - nb && map_size (calendar) == (size_t)NB - nb);
+    struct event *previous = 0;
+    map_traverse (calendar, check_event_order, &previous, 0, 0);
+    assert (previous && previous->id == NB - 1);
+    map_traverse (calendar, MAP_REMOVE_ALL, 0, 0, 0);
+  }
+  map_destroy (calendar);
+  free (events);
+  fprintf (stdout, "%'zu middle elements of %'zu equal elements removed, four times.\n", (size_t)NB - 2, (size_t)NB);
+}
+
+static int
+check_consecutive (void *data, void *op_arg, int *, const void *) {
+  int *expected = op_arg;
+  assert (*(int *)data == (*expected)++);
+  return 1;
+}
+
+static int
+die_traversing (void *, void *, int *, const void *) {
+  _exit (0); // The process dies holding the mutex of the map, in the middle of a traversal.
+}
+
+static void
+test17 (void) {
+  enum { NB_PROCESSES = 4, NB = 10 * 1000 };
+  puts ("============================================================");
+  // The data, as the map, are shared between the processes.
+  int *ints = mmap (0, NB_PROCESSES * NB * sizeof (*ints), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  map *shared = map_create_shared (0, cmpip, 0, 1, NB_PROCESSES * NB);
+  assert (ints != MAP_FAILED && shared);
+  pid_t pids[NB_PROCESSES];
+  for (int p = 0; p < NB_PROCESSES; p++) {
+    assert ((pids[p] = fork ()) >= 0);
+    if (!pids[p]) { // The processes insert concurrently, interleaved values.
+      for (int i = 0; i < NB; i++) {
+        ints[p * NB + i] = i * NB_PROCESSES + p;
+        if (!map_insert_data (shared, &ints[p * NB + i]))
+          _exit (1);
+      }
+      _exit (0); // Not exit: the handlers at exit belong to the parent process.
+    }
+  }
+  for (int p = 0, status; p < NB_PROCESSES; p++)
+    assert (waitpid (pids[p], &status, 0) == pids[p] && WIFEXITED (status) && !WEXITSTATUS (status));
+  assert (map_size (shared) == NB_PROCESSES * NB);
+  (map_display) (shared, 0, 0); // map_check, on the whole map.
+  int expected = 0;
+  assert (map_traverse (shared, check_consecutive, &expected, 0, 0) == NB_PROCESSES * NB && expected == NB_PROCESSES * NB);
+  int extra = -1;
+  errno = 0;
+  assert (!map_insert_data (shared, &extra) && errno == ENOMEM); // The pool is exhausted.
+  fprintf (stdout, "%'d elements inserted by %d processes into a shared map.\n", NB_PROCESSES * NB, NB_PROCESSES);
+
+  // Elements are reallocated when moved out of (and back into) the pool.
+  map *private = map_create (0, cmpip, 0, 1);
+  assert (private);
+  assert (map_traverse (shared, MAP_MOVE_TO, private, 0, 0) == NB_PROCESSES * NB && !map_size (shared) && map_size (private) == NB_PROCESSES * NB);
+  assert (map_traverse (private, MAP_MOVE_TO, shared, 0, 0) == NB_PROCESSES * NB && map_size (shared) == NB_PROCESSES * NB && !map_size (private));
+  expected = 0;
+  map_traverse (shared, check_consecutive, &expected, 0, 0);
+  assert (expected == NB_PROCESSES * NB);
+  assert (map_destroy (private));
+
+  // A process dies holding the (robust) mutex of the map: the map is recovered by the next one to lock it.
+  pid_t pid = fork ();
+  assert (pid >= 0);
+  if (!pid)
+    map_traverse (shared, die_traversing, 0, 0, 0);
+  int status;
+  assert (waitpid (pid, &status, 0) == pid && WIFEXITED (status));
+  assert (map_clear (shared, 0) == NB_PROCESSES * NB); // The traversal of the dead process is over: the map can be cleared.
+  assert (map_insert_data (shared, &extra) && map_size (shared) == 1);
+  (map_display) (shared, 0, 0);
+  assert (map_destroy_all (shared, 0));
+  munmap (ints, NB_PROCESSES * NB * sizeof (*ints));
+  fprintf (stdout, "Shared map recovered after the death of a process holding its mutex.\n");
+}
+
 int
 main (void) {
   setlocale (LC_ALL, "");
@@ -566,4 +1334,15 @@ main (void) {
   test4 ();
   test5 ();
   test6 ();
+  test7 ();
+  test8 ();
+  test9 ();
+  test10 ();
+  test11 ();
+  test12 ();
+  test13 ();
+  test14 ();
+  test15 ();
+  test16 ();
+  test17 ();
 }
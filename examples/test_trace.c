@@ -0,0 +1,125 @@
+// (c) L. Farhi, 2024
+// Language: C (C11 or higher)
+// Checks the ring buffers of trace.h: built with TRACE_RING (see the Makefile), the records of each thread are dumped in order,
+// as lines of text and as Chrome trace-event JSON, the oldest ones being overwritten.
+#undef NDEBUG
+#ifndef TRACE_RING
+#  error "test_trace should be compiled with -DTRACE_RING."
+#endif
+#define TRACE_RING_SIZE 256
+#include "trace.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+
+static const int NB_THREADS = 4, NB_CALLS = 100, NB_OVERWRITTEN = 10;
+
+static int
+square (int x) {
+  return x * x;
+}
+#define square(...) TRACE_EXPRESSION (square (__VA_ARGS__))
+
+static int
+worker (void *arg) {
+  int id = *(int *)arg, sum = 0;
+  for (int i = 0; i < NB_CALLS; i++) {
+    sum += square (i);
+    TRACE_FORMAT ("call %d of thread %d", i, id);
+  }
+  return sum;
+}
+
+int
+main (void) {
+  thrd_t threads[NB_THREADS];
+  int ids[NB_THREADS];
+  for (int t = 0; t < NB_THREADS; t++) {
+    ids[t] = t;
+    assert (thrd_create (&threads[t], worker, &ids[t]) == thrd_success);
+  }
+  for (int t = 0; t < NB_THREADS; t++)
+    thrd_join (threads[t], 0);
+  for (int i = 0; i < TRACE_RING_SIZE + NB_OVERWRITTEN; i++) // The ring of the main thread overflows.
+    TRACE_FORMAT ("overflow %d", i);
+  TRACE_FORMAT ("%s", "a message longer than TRACE_RING_MESSAGE characters");
+
+  // Text: the records of a thread are contiguous and in order.
+  FILE *stream = tmpfile ();
+  assert (stream);
+  trace_ring_dump (stream, TRACE_RING_TEXT);
+  rewind (stream);
+  char line[256], func[64], text[128];
+  int nb_worker_lines = 0, nb_overflow = 0, nb_long = 0, nb_overwritten = 0, threads_seen = 0, id = -1;
+  unsigned long long seconds, nanoseconds, previous = 0;
+  unsigned long thread;
+  while (fgets (line, sizeof (line), stream)) {
+    size_t nb;
+    if (sscanf (line, "[%lX] %zu records overwritten", &thread, &nb) == 2) {
+      assert (nb == (size_t)NB_OVERWRITTEN + 1 && !nb_overwritten++);
+      continue;
+    }
+    int n = 0;
+    assert (sscanf (line, "%llu.%llu [%lX:%63[^]]] %n", &seconds, &nanoseconds, &thread, func, &n) == 4 && n);
+    char *site = strrchr (line, '<');
+    assert (site && strstr (site, "test_trace.c:"));
+    size_t length = (size_t)(site - line - n);
+    assert (length && length < sizeof (text) && line[n + (int)length - 1] == ' ');
+    memcpy (text, line + n, length - 1);
+    text[length - 1] = 0;
+    unsigned long long ns = seconds * 1000000000ULL + nanoseconds;
+    if (!strcmp (func, "worker")) {
+      int call = nb_worker_lines / 2 % NB_CALLS, i, t;
+      if (nb_worker_lines % (2 * NB_CALLS) == 0) // The first record of a worker
+        previous = 0;
+      if (nb_worker_lines % 2 == 0)
+        assert (!strcmp (text, "square (i)"));
+      else {
+        assert (sscanf (text, "call %d of thread %d", &i, &t) == 2 && i == call);
+        if (!call) {
+          id = t;
+          threads_seen |= 1 << t;
+        }
+        assert (t == id);
+      }
+      nb_worker_lines++;
+    } else {
+      assert (!strcmp (func, "main"));
+      if (nb_overflow + NB_OVERWRITTEN + 1 == TRACE_RING_SIZE + NB_OVERWRITTEN) { // The last record, truncated.
+        assert (strlen (text) == TRACE_RING_MESSAGE - 1 && !strncmp (text, "a message longer", 16));
+        nb_long++;
+      } else {
+        int i;
+        assert (sscanf (text, "overflow %d", &i) == 1 && i == nb_overflow + NB_OVERWRITTEN + 1); // The oldest records are overwritten.
+        if (!nb_overflow)
+          previous = 0;
+        nb_overflow++;
+      }
+    }
+    assert (ns >= previous); // Timestamped in order within a thread.
+    previous = ns;
+  }
+  assert (nb_worker_lines == 2 * NB_CALLS * NB_THREADS && threads_seen == (1 << NB_THREADS) - 1);
+  assert (nb_overflow == TRACE_RING_SIZE - 1 && nb_long == 1 && nb_overwritten == 1);
+  fclose (stream);
+
+  // Chrome trace-event JSON: a thread name per ring, an instant event per record.
+  assert ((stream = tmpfile ()));
+  trace_ring_dump (stream, TRACE_RING_CHROME);
+  rewind (stream);
+  int nb_names = 0, nb_events = 0, last = 0;
+  assert (fgets (line, sizeof (line), stream) && !strcmp (line, "{\"traceEvents\": [\n"));
+  while (fgets (line, sizeof (line), stream)) {
+    assert (!last);
+    if (strstr (line, "\"ph\": \"M\""))
+      nb_names++;
+    else if (strstr (line, "\"ph\": \"i\""))
+      nb_events++;
+    else
+      last = !strcmp (line, "]}\n");
+  }
+  assert (last && nb_names == NB_THREADS + 1 && nb_events == 2 * NB_CALLS * NB_THREADS + TRACE_RING_SIZE);
+  fclose (stream);
+  fprintf (stdout, "%d records of %d threads dumped as text and as JSON.\n", nb_events, nb_names);
+}
@@ -1,13 +1,38 @@
 // (c) L. Farhi, 2024
 // Language: C (C11 or higher)
+#define _POSIX_C_SOURCE 200809L // for mmap, munmap, fstat, write, shm_open, robust mutexes
 #undef NDEBUG
 #include "map.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Static tracepoints (USDT) of the provider 'map', if <sys/sdt.h> is available (and MAP_NO_PROBES is not defined.) See "Static tracepoints" in map.h.
+#if defined(__has_include) && !defined(MAP_NO_PROBES)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define _map_probe1(name, a) DTRACE_PROBE1 (map, name, a)
+#    define _map_probe2(name, a, b) DTRACE_PROBE2 (map, name, a, b)
+#    define _map_probe3(name, a, b, c) DTRACE_PROBE3 (map, name, a, b, c)
+#  endif
+#endif
+#ifndef _map_probe1
+#  define _map_probe1(name, a) ((void)0)
+#  define _map_probe2(name, a, b) ((void)0)
+#  define _map_probe3(name, a, b, c) ((void)0)
+#endif
 
 const size_t MAP_VERSION_MAJOR = 2;
 const size_t MAP_VERSION_MINOR = 0;
@@ -18,8 +43,9 @@ struct map_elem {
   struct map_elem *previous_lt, *next_gt;                                                                                          // Double-linked list structure between nodes of different keys
   void *data;
   const void *key_from_data;
-  struct map *map; // Owner
-  size_t height;   // Distance to the bottom of the tree
+  struct map *map;  // Owner
+  size_t height;    // Distance to the bottom of the tree
+  size_t nb_equal;  // Number of elements with the same key (the head of equal elements only)
 };
 
 struct map {
@@ -28,37 +54,232 @@ struct map {
   map_key_comparator cmp_key;
   map_key_extractor get_key;
   const void *cmp_arg;
+  map_key_comparator cmp_data; // Secondary comparator of the elements of equal keys (optional)
+  const void *cmp_data_arg;
   int uniqueness; // Property
   size_t nb_balancing;
   size_t nb_elem;
   void *context;
+  int splaying;         // Property
+  int splayed;          // The tree has been splayed, and might not respect the balancing criterion (see MAP_BALANCING_THRESHOLD)
+  size_t traversing;    // Depth of the nested traversals (or finds) in progress
+  size_t nb_unlinked;   // Number of elements unlinked so far, which tells a traversal if an operator has unlinked elements by nested calls (see _map_head)
+  size_t nb_rebalanced; // Number of removals rebalanced one by one during the traversals in progress (see _map_balance_after_removal)
+  int unbalanced;       // Rebalancing of removals has been deferred till the end of the traversals: the tree is rebuilt then (see _map_rebalance)
+  struct map_mapping {
+    void *addr;
+    size_t length;
+    atomic_size_t *nb_refs; // Number of lists sharing the mapping (maps, snapshots, reclamations). The last one unmaps the file.
+    struct map_mapping *next;
+  } *mappings;                 // Files mapped in memory by map_load_mmap, referred to by data
+  struct map_journal *journal; // Journal of the modifications of the map, set by map_set_journal
+  uint64_t generation;         // Generation of the journal of the map, as loaded by map_load_mmap and set by map_checkpoint
+  struct map_elem *rekeyed;    // Elements which keys were changed in place (MAP_REKEY), chained by eq_next, till the end of the outermost traversal (see _map_relink)
+  struct map_stats stats;      // Counters, updated under the mutex of the map (see map_stats)
+  struct map_pool *pool;       // Pool of the elements of a map shared between processes, in the same segment of shared memory (see map_create_shared), 0 otherwise
+#ifdef MAP_LOCK_PROFILING
+#  define MAP_LOCK_PROFILE_BUCKETS 64
+  struct map_lock_profile {
+    struct map_lock_site {
+      const char *name; // Function of map.c locking the map
+      size_t nb_locks;
+      unsigned long long wait_ns, hold_ns;
+      size_t wait[MAP_LOCK_PROFILE_BUCKETS], hold[MAP_LOCK_PROFILE_BUCKETS]; // Log-scale histograms of durations (see _map_log2)
+    } sites[32], *holder;
+    size_t nb_sites;
+    size_t depth; // Of recursive acquisitions of the mutex
+    struct timespec acquired;
+  } profile; // Updated under the mutex of the map
+#endif
+};
+
+// A map shared between processes (see map_create_shared) lies in a segment of POSIX shared memory, followed by its pool of elements.
+// Its mutex is a process-shared, robust and recursive pthread mutex of the pool, in place of the mutex (mtx_t) of the map.
+struct map_pool {
+  pthread_mutex_t map_mutex; // Mutex of the map
+  pthread_mutex_t mutex;     // Mutex of the pool, for allocations and deallocations of elements (which can be done outside the mutex of the map)
+  size_t length;             // Of the segment
+  size_t capacity;           // Number of elements of the pool
+  size_t next;               // Index of the first element of the pool never allocated
+  struct map_elem *free;     // Deallocated elements, chained by next_gt
+  struct map_elem elems[];
+};
+
+// _map_now returns the current time of a monotonic clock into 't', for measuring durations unaffected by changes of the system time.
+static void
+_map_now (struct timespec *t) {
+  clock_gettime (CLOCK_MONOTONIC, t);
+}
+
+static unsigned long long
+_map_elapsed_ns (const struct timespec *t0, const struct timespec *t1) {
+  return (unsigned long long)((t1->tv_sec - t0->tv_sec) * 1000000000LL + (t1->tv_nsec - t0->tv_nsec));
+}
+
+#ifdef MAP_LOCK_PROFILING
+// _map_lock_site returns the profile of the call site 'name' (a function of map.c). The mutex of 'l' MUST be locked by the caller.
+static struct map_lock_site *
+_map_lock_site (struct map *l, const char *name) {
+  struct map_lock_profile *p = &l->profile;
+  size_t i = 0;
+  while (i < p->nb_sites && p->sites[i].name != name) // Names are the (static) __func__ of the call sites.
+    i++;
+  if (i == p->nb_sites) {
+    if (i == sizeof (p->sites) / sizeof (*p->sites))
+      return &p->sites[i - 1]; // Should not happen: there are fewer call sites in map.c.
+    p->sites[p->nb_sites++].name = name;
+  }
+  return &p->sites[i];
+}
+
+// _map_log2 returns the index of the bucket of a log-scale histogram for the duration 'ns': 0 for 0, k for [2^(k-1), 2^k).
+static size_t
+_map_log2 (unsigned long long ns) {
+  size_t k = 0;
+  for (; ns; ns >>= 1)
+    k++;
+  return k < MAP_LOCK_PROFILE_BUCKETS ? k : MAP_LOCK_PROFILE_BUCKETS - 1;
+}
+#endif
+
+// _map_rebalance rebuilds the tree if the balancing of removals was deferred (defined below, with the balancing of the tree.)
+static void _map_rebalance (struct map *l);
+// _map_relink links back the elements which keys were changed in place during a traversal (defined below, with the traversals.)
+static void _map_relink (struct map *l);
+
+// _map_lock_shared locks, with 'lock' (pthread_mutex_lock or pthread_mutex_trylock), the mutex of the map 'l' shared between processes (see map_create_shared.)
+// The mutex is robust: if the process holding it died, in the middle of a traversal for instance, the mutex is acquired nonetheless, the traversals of the dead process
+// are ended and the tree is rebuilt from the list of elements.
+// Returns 0 if the mutex is locked by the calling thread, an error number otherwise (EBUSY if locked by another thread.)
+static int
+_map_lock_shared (struct map *l, int (*lock) (pthread_mutex_t *), const char *site) {
+  int ret = lock (&l->pool->map_mutex);
+  if (ret != EOWNERDEAD)
+    return ret;
+  fprintf (stderr, "%s: %s\n", site, "A process died holding the mutex of the shared map. The element it was modifying, if any, might be inconsistent.");
+  pthread_mutex_consistent (&l->pool->map_mutex);
+  l->traversing = 0; // The mutex is held for the whole of a traversal: traversals in progress were those of the dead process.
+  l->unbalanced = 1;
+  _map_rebalance (l);
+  _map_relink (l);
+#ifdef MAP_LOCK_PROFILING
+  l->profile.depth = 0;
+#endif
+  return 0;
+}
+
+// _map_lock locks the mutex of the map 'l', and counts the acquisitions, the contended ones and the time spent waiting for them.
+// With MAP_LOCK_PROFILING defined, the wait and hold times of each call site (the calling function 'site') are also recorded in histograms (see map_lock_profile).
+#define _map_lock(l) _map_lock_at ((l), __func__)
+static void
+_map_lock_at (struct map *l, const char *site) {
+  struct timespec t0, t1;
+  unsigned long long wait = 0;
+#ifdef MAP_LOCK_PROFILING
+  _map_now (&t0);
+#endif
+  if (l->pool ? _map_lock_shared (l, pthread_mutex_trylock, site) != 0 : mtx_trylock (&l->mutex) != thrd_success) { // Contended: timed.
+#ifndef MAP_LOCK_PROFILING
+    _map_now (&t0);
+#endif
+    if (l->pool)
+      _map_lock_shared (l, pthread_mutex_lock, site);
+    else
+      mtx_lock (&l->mutex);
+    _map_now (&t1);
+    l->stats.nb_contended_locks++;
+    l->stats.lock_wait_ns += wait = _map_elapsed_ns (&t0, &t1);
+  }
+#ifdef MAP_LOCK_PROFILING
+  else {
+    _map_now (&t1);
+    wait = _map_elapsed_ns (&t0, &t1);
+  }
+  if (!l->profile.depth++) { // Outermost acquisition (the mutex is recursive): the hold time is accounted to it.
+    struct map_lock_site *holder = l->profile.holder = _map_lock_site (l, site);
+    holder->nb_locks++;
+    holder->wait_ns += wait;
+    holder->wait[_map_log2 (wait)]++;
+    l->profile.acquired = t1;
+  }
+#endif
+  (void)site;
+  l->stats.nb_locks++;
+  _map_probe3 (lock__acquire, l, site, wait);
+}
+
+static void
+_map_unlock (struct map *l) {
+#ifdef MAP_LOCK_PROFILING
+  if (!--l->profile.depth) {
+    struct timespec t;
+    _map_now (&t);
+    unsigned long long hold = _map_elapsed_ns (&l->profile.acquired, &t);
+    l->profile.holder->hold_ns += hold;
+    l->profile.holder->hold[_map_log2 (hold)]++;
+  }
+#endif
+  _map_probe1 (lock__release, l);
+  if (l->pool)
+    pthread_mutex_unlock (&l->pool->map_mutex);
+  else
+    mtx_unlock (&l->mutex);
+}
+
+// The journal of a map is defined below, next to the format of a dump it shares its records with.
+// _map_journal_data appends the insertion (or removal) of 'data' to the journal of 'l'. The mutex of 'l' MUST be locked by the caller.
+static void _map_journal_data (struct map *l, int removal, const void *data);
+// _map_journal_keep saves the serialized form of 'data' into 'kept', before an operator is called (which might free data) and the element possibly removed.
+struct map_kept {
+  void *bytes;
+  size_t size, capacity;
+  int valid;
 };
+static void _map_journal_keep (struct map *l, struct map_kept *kept, const void *data);
+// _map_journal_kept appends the removal of the element which serialized form is in 'kept' to the journal of 'l'. The mutex of 'l' MUST be locked by the caller.
+static void _map_journal_kept (struct map *l, const struct map_kept *kept);
+// _map_journal_clear appends the removal of all the elements to the journal of 'l'. The mutex of 'l' MUST be locked by the caller.
+static void _map_journal_clear (struct map *l);
+// _map_journal_sync writes and synchronises all the records appended to the journal so far. The mutex of the map should NOT be locked by the caller (for group commit).
+static int _map_journal_sync (struct map_journal *j);
+static void _map_journal_free (struct map_journal *j);
 
 static const void *
 _MAP_KEY_IS_DATA (void *data) {
   return data;
 }
 
-__attribute__ ((warn_unused_result)) struct map *
-map_create (map_key_extractor get_key, map_key_comparator cmp_key, const void *arg, int unicity) {
+// _map_init sets the keys of the map 'l', which attributes are all set to 0, as required by map_create (or map_create_shared, the 'caller'.)
+// Returns 0 (with errno set to EPERM) if the key comparator is undefined though needed, 1 otherwise.
+static int
+_map_init (struct map *l, map_key_extractor get_key, map_key_comparator cmp_key, const void *arg, int unicity, const char *caller) {
   if (!get_key && cmp_key)
     get_key = _MAP_KEY_IS_DATA;
   if ((unicity || get_key) && !cmp_key) {
     errno = EPERM;
-    fprintf (stderr, "%s: %s\n", __func__, "Undefined key comparator.");
+    fprintf (stderr, "%s: %s\n", caller, "Undefined key comparator.");
     return 0;
   }
+  l->get_key = get_key;
+  l->cmp_key = cmp_key;
+  l->uniqueness = unicity;
+  l->cmp_arg = arg;
+  l->context = l; // By default, the contexte of a map is the map itself.
+  return 1;
+}
+
+__attribute__ ((warn_unused_result)) struct map *
+map_create (map_key_extractor get_key, map_key_comparator cmp_key, const void *arg, int unicity) {
   struct map *l = calloc (1, sizeof (*l)); // All attributes are set to 0.
   if (!l) {
     errno = ENOMEM;
     fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
     return 0;
   }
-  l->get_key = get_key;
-  l->cmp_key = cmp_key;
-  l->uniqueness = unicity;
-  l->cmp_arg = arg;
-  l->context = l; // By default, the contexte of a map is the map itself.
+  if (!_map_init (l, get_key, cmp_key, arg, unicity, __func__)) {
+    free (l);
+    return 0;
+  }
   // mtx_recursive : the SAME thread can lock (and unlock) the mutex several times. See https://en.wikipedia.org/wiki/Reentrant_mutex for more.
   // Therefore, map_find_key, map_traverse, map_traverse_backward and map_insert_data can call each other.
   if (mtx_init (&l->mutex, mtx_plain | mtx_recursive) != thrd_success) {
@@ -70,58 +291,493 @@ map_create (map_key_extractor get_key, map_key_comparator cmp_key, const void *a
   return l;
 }
 
+__attribute__ ((warn_unused_result)) struct map *
+map_create_shared (map_key_extractor get_key, map_key_comparator cmp_key, const void *arg, int unicity, size_t capacity) {
+  // The segment holds the map, followed by its pool of 'capacity' elements.
+  size_t offset = (sizeof (struct map) + _Alignof (struct map_pool) - 1) / _Alignof (struct map_pool) * _Alignof (struct map_pool);
+  if (!capacity || capacity > (SIZE_MAX - offset - sizeof (struct map_pool)) / sizeof (struct map_elem)) {
+    errno = EINVAL;
+    fprintf (stderr, "%s: %s\n", __func__, "Invalid capacity.");
+    return 0;
+  }
+  size_t length = offset + sizeof (struct map_pool) + capacity * sizeof (struct map_elem);
+  // The name of the segment is removed as soon as it is open: the segment is released when the last process sharing it unmaps it (or ends.)
+  static atomic_size_t nb_segments;
+  char name[64];
+  snprintf (name, sizeof (name), "/map.%ld.%zu", (long)getpid (), atomic_fetch_add (&nb_segments, 1));
+  int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0)
+    shm_unlink (name);
+  struct map *l = fd >= 0 && !ftruncate (fd, (off_t)length) ? mmap (0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED; // All attributes are set to 0.
+  if (fd >= 0)
+    close (fd);
+  if (l == MAP_FAILED) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Could not allocate shared memory.");
+    return 0;
+  }
+  struct map_pool *pool = l->pool = (struct map_pool *)((char *)l + offset);
+  pool->length = length;
+  pool->capacity = capacity;
+  // Both mutexes are shared between processes, and robust (see _map_lock_shared). The mutex of the map is recursive, as is the mutex of a map created by map_create.
+  pthread_mutexattr_t attr;
+  int ok = !pthread_mutexattr_init (&attr);
+  if (ok) {
+    ok = !pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED) && !pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST) &&
+         !pthread_mutex_init (&pool->mutex, &attr) && !pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE) &&
+         !pthread_mutex_init (&pool->map_mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
+  }
+  if (!ok || !_map_init (l, get_key, cmp_key, arg, unicity, __func__)) {
+    if (!ok) {
+      errno = ENOMEM;
+      fprintf (stderr, "%s: %s\n", __func__, "Could not initialise the mutexes.");
+    }
+    munmap (l, length);
+    return 0;
+  }
+  return l;
+}
+
+// _map_alloc allocates an element for the map 'l', with all its attributes set to 0, from the pool of 'l' if it is shared between processes.
+// Returns 0 if out of memory (or if the pool is exhausted.) The mutex of 'l' is not needed.
+static struct map_elem *
+_map_alloc (struct map *l) {
+  struct map_pool *pool = l->pool;
+  if (!pool)
+    return calloc (1, sizeof (struct map_elem));
+  if (pthread_mutex_lock (&pool->mutex) == EOWNERDEAD) // A process died allocating or deallocating an element: at worst, the element is lost.
+    pthread_mutex_consistent (&pool->mutex);
+  struct map_elem *e = pool->free;
+  if (e)
+    pool->free = e->next_gt;
+  else if (pool->next < pool->capacity)
+    e = &pool->elems[pool->next++];
+  pthread_mutex_unlock (&pool->mutex);
+  if (e)
+    *e = (struct map_elem){ 0 };
+  return e;
+}
+
+// _map_free deallocates the element 'e', allocated by _map_alloc from 'pool' (0 if not from a pool.)
+static void
+_map_free (struct map_pool *pool, struct map_elem *e) {
+  if (!pool) {
+    free (e);
+    return;
+  }
+  if (pthread_mutex_lock (&pool->mutex) == EOWNERDEAD)
+    pthread_mutex_consistent (&pool->mutex);
+  e->next_gt = pool->free;
+  pool->free = e;
+  pthread_mutex_unlock (&pool->mutex);
+}
+
 void *
 map_set_context (map *m, void *context) {
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   void *previous = m->context;
   m->context = context;
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
+  return previous;
+}
+
+int
+map_set_splaying (map *m, int splaying) {
+  _map_lock (m);
+  int previous = m->splaying;
+  if ((m->splaying = splaying) || !m->splayed) {
+    _map_unlock (m);
+    return previous;
+  }
+  m->splayed = 0; // The tree is rebuilt to respect the balancing criterion again, now or at the end of the traversals in progress.
+  m->unbalanced = 1;
+  if (!m->traversing)
+    _map_rebalance (m);
+  _map_unlock (m);
   return previous;
 }
 
+int
+map_set_secondary_comparator (map *m, map_key_comparator cmp_data, const void *arg) {
+  if (!m || !cmp_data) {
+    errno = EINVAL;
+    return 0;
+  }
+  _map_lock (m);
+  int ret = !m->first && m->cmp_key && !m->uniqueness;
+  if (ret) {
+    m->cmp_data = cmp_data;
+    m->cmp_data_arg = arg;
+  } else {
+    errno = EPERM;
+    fprintf (stderr, "%s: %s\n", __func__, "Not an empty map of keys with duplicates.");
+  }
+  _map_unlock (m);
+  return ret;
+}
+
+// _map_free_mappings deallocates a list of mappings, and unmaps the files it was the last one to share.
+static void
+_map_free_mappings (struct map_mapping *mappings) {
+  for (struct map_mapping *mapping = mappings, *next; mapping; mapping = next) {
+    next = mapping->next;
+    if (atomic_fetch_sub (mapping->nb_refs, 1) == 1) {
+      munmap (mapping->addr, mapping->length);
+      free (mapping->nb_refs);
+    }
+    free (mapping);
+  }
+}
+
+// _map_free_map deallocates an empty map. The mutex of 'l' should NOT be locked by the caller.
+// A map shared between processes is only unmapped from the calling process: the other processes sharing it can go on using it.
+static void
+_map_free_map (struct map *l) {
+  if (l->pool) { // Neither journaled nor loaded by map_load_mmap.
+    munmap (l, l->pool->length);
+    return;
+  }
+  mtx_destroy (&l->mutex);
+  _map_journal_free (l->journal);
+  _map_free_mappings (l->mappings);
+  free (l);
+}
+
 int
 map_destroy (struct map *l) {
   if (!l) {
     errno = EINVAL;
     return 0;
   }
-  mtx_lock (&l->mutex);
+  _map_lock (l);
   if (l->first) {
     errno = EPERM;
     fprintf (stderr, "%s: %s\n", __func__, "Not empty. Not destroyed.");
-    mtx_unlock (&l->mutex);
+    _map_unlock (l);
     return 0;
   }
-  mtx_unlock (&l->mutex);
-  mtx_destroy (&l->mutex);
-  free (l);
+  _map_unlock (l);
+  _map_free_map (l);
+  return 1;
+}
+
+// _map_is_mapped tells if 'data' is used in place in a file mapped by map_load_mmap (and should therefore not be free'd.)
+static int
+_map_is_mapped (const struct map_mapping *mappings, const void *data) {
+  for (const struct map_mapping *mapping = mappings; mapping; mapping = mapping->next)
+    if ((const char *)data >= (const char *)mapping->addr && (const char *)data < (const char *)mapping->addr + mapping->length)
+      return 1;
+  return 0;
+}
+
+// _map_detach detaches all the elements from the map 'l', which is left empty, and returns the first one. The mutex of 'l' MUST be locked by the caller.
+// The detached elements remain chained in order, distinct keys by next_gt, equal keys by eq_next (see _map_free_detached.)
+static struct map_elem *
+_map_detach (struct map *l) {
+  struct map_elem *first = l->first;
+  l->stats.nb_removals += l->nb_elem;
+  l->root = l->first = l->last = 0;
+  l->nb_elem = l->nb_rebalanced = 0;
+  l->unbalanced = 0;
+  return first;
+}
+
+// _map_free_detached deallocates at most 'max' elements detached by _map_detach, from '*first', in a single pass without any rebalancing,
+// and applies 'dtor' (if not 0) on their data (except on data used in place in a file mapped by map_load_mmap.) The mutex of the map is not needed.
+// The elements are deallocated back to 'pool' if the map is shared between processes (see _map_free.)
+// '*first' is updated to the first remaining element. Returns the number of elements deallocated.
+static size_t
+_map_free_detached (struct map_elem **first, size_t max, void (*dtor) (void *), const struct map_mapping *mappings, struct map_pool *pool) {
+  size_t nb = 0;
+  struct map_elem *e = *first;
+  for (struct map_elem *next; e && nb < max; e = next, nb++) {
+    if ((next = e->eq_next))
+      next->next_gt = e->next_gt; // The next equal element replaces its head, to be resumed from.
+    else
+      next = e->next_gt;
+    if (dtor && !_map_is_mapped (mappings, e->data))
+      dtor (e->data);
+    _map_free (pool, e);
+  }
+  *first = e;
+  return nb;
+}
+
+// _map_copy_mappings returns a copy of a non-empty list of mappings, sharing the mapped files with it, or 0 if out of memory.
+static struct map_mapping *
+_map_copy_mappings (const struct map_mapping *mappings) {
+  struct map_mapping *copy = 0, **tail = &copy;
+  for (const struct map_mapping *mapping = mappings; mapping; mapping = mapping->next, tail = &(*tail)->next)
+    if (!(*tail = malloc (sizeof (**tail)))) {
+      _map_free_mappings (copy);
+      return 0;
+    } else {
+      **tail = (struct map_mapping){ .addr = mapping->addr, .length = mapping->length, .nb_refs = mapping->nb_refs };
+      atomic_fetch_add (mapping->nb_refs, 1);
+    }
+  return copy;
+}
+
+// Asynchronous reclamation (map_clear_async and map_destroy_async): the detached elements are deallocated by a background thread, the reclaimer,
+// by batches of MAP_RECLAIM_BATCH elements separated by pauses of MAP_RECLAIM_PAUSE_NS nanoseconds, which bounds the rate of deallocations
+// (and therefore the contention on the memory allocator with the other threads.)
+// The reclaimer is started on first use. At exit, it deallocates the remaining elements without pause, and is joined.
+#ifndef MAP_RECLAIM_BATCH
+#  define MAP_RECLAIM_BATCH 4096
+#endif
+#ifndef MAP_RECLAIM_PAUSE_NS
+#  define MAP_RECLAIM_PAUSE_NS 100000
+#endif
+
+struct map_reclaim {
+  struct map_elem *first; // Remaining elements to be deallocated
+  void (*dtor) (void *);
+  struct map_mapping *mappings; // Files mapped by map_load_mmap, released at the end (and unmapped if no longer shared)
+  struct map_reclaim *next;
+};
+
+static struct {
+  thrd_t thread;
+  mtx_t mutex;
+  cnd_t condition;
+  struct map_reclaim *first, *last; // Queue of pending reclamations
+  int started, stop;
+} Reclaimer = { 0 };
+
+static int
+_map_reclaimer_loop (void *arg) {
+  (void)arg;
+  mtx_lock (&Reclaimer.mutex);
+  while (1) {
+    while (!Reclaimer.first && !Reclaimer.stop)
+      cnd_wait (&Reclaimer.condition, &Reclaimer.mutex);
+    struct map_reclaim *r = Reclaimer.first; // Only the reclaimer removes reclamations from the queue.
+    int stop = Reclaimer.stop;
+    if (!r)
+      break; // Stopped, and nothing left to deallocate.
+    mtx_unlock (&Reclaimer.mutex);
+    _map_free_detached (&r->first, stop ? SIZE_MAX : MAP_RECLAIM_BATCH, r->dtor, r->mappings, 0);
+    if (!r->first)
+      _map_free_mappings (r->mappings);
+    else if (!stop)
+      thrd_sleep (&(struct timespec){ .tv_nsec = MAP_RECLAIM_PAUSE_NS }, 0);
+    mtx_lock (&Reclaimer.mutex);
+    if (!r->first) {
+      if (!(Reclaimer.first = r->next))
+        Reclaimer.last = 0;
+      free (r);
+    }
+  }
+  mtx_unlock (&Reclaimer.mutex);
+  return 0;
+}
+
+static void
+_map_reclaimer_stop (void) {
+  mtx_lock (&Reclaimer.mutex);
+  Reclaimer.stop = 1;
+  cnd_signal (&Reclaimer.condition);
+  mtx_unlock (&Reclaimer.mutex);
+  thrd_join (Reclaimer.thread, 0);
+}
+
+static once_flag RECLAIMER_INIT = ONCE_FLAG_INIT;
+static void
+_map_reclaimer_init (void) // Called once.
+{
+  if (mtx_init (&Reclaimer.mutex, mtx_plain) != thrd_success || cnd_init (&Reclaimer.condition) != thrd_success)
+    return;
+  if ((Reclaimer.started = thrd_create (&Reclaimer.thread, _map_reclaimer_loop, 0) == thrd_success))
+    atexit (_map_reclaimer_stop);
+}
+
+// _map_reclaim hands detached elements (and mappings) over to the reclaimer. Returns 0 if the reclaimer is not available (the caller then deallocates them), 1 otherwise.
+static int
+_map_reclaim (struct map_elem *first, void (*dtor) (void *), struct map_mapping *mappings) {
+  call_once (&RECLAIMER_INIT, _map_reclaimer_init);
+  struct map_reclaim *r = Reclaimer.started ? malloc (sizeof (*r)) : 0;
+  if (!r)
+    return 0;
+  *r = (struct map_reclaim){ .first = first, .dtor = dtor, .mappings = mappings };
+  mtx_lock (&Reclaimer.mutex);
+  int ok = !Reclaimer.stop; // Not after exit has begun.
+  if (ok) {
+    Reclaimer.last = Reclaimer.last ? (Reclaimer.last->next = r) : (Reclaimer.first = r);
+    cnd_signal (&Reclaimer.condition);
+  }
+  mtx_unlock (&Reclaimer.mutex);
+  if (!ok)
+    free (r);
+  return ok;
+}
+
+// _map_clear removes all the elements of the map 'm'. They are deallocated by the calling thread or, if 'async', by the reclaimer.
+// If 'destroy', the map, emptied under its mutex, is then destroyed (as by map_destroy), and the files mapped by map_load_mmap are handed over with the elements,
+// to be unmapped once they are deallocated.
+// Returns 0 if the map is being traversed by the calling thread (and is not cleared), 1 otherwise, with the number of elements removed in '*nb'.
+static int
+_map_clear (map *m, void (*dtor) (void *), int async, int destroy, const char *caller, size_t *nb) {
+  *nb = 0;
+  if (!m) {
+    errno = EINVAL;
+    return 0;
+  }
+  _map_lock (m);
+  if (m->traversing) {
+    _map_unlock (m);
+    errno = EPERM;
+    fprintf (stderr, "%s: %s\n", caller, destroy ? "Map being traversed. Not destroyed." : "Map being traversed. Not cleared.");
+    return 0;
+  }
+  *nb = m->nb_elem;
+  struct map_elem *first = _map_detach (m);
+  if (*nb && m->journal)
+    _map_journal_clear (m);
+  struct map_journal *journal = *nb ? m->journal : 0;
+  struct map_mapping *mappings = m->mappings, *copy = 0;
+  struct map_pool *pool = m->pool;
+  if (pool)
+    async = 0; // The reclaimer is a thread of the calling process only, and the map might be unmapped before it is done.
+  if (destroy)
+    m->mappings = 0;
+  else if (async && first && mappings) {
+    if ((copy = _map_copy_mappings (mappings)))
+      mappings = copy; // The map might be destroyed before its elements are deallocated.
+    else
+      async = 0; // Out of memory: the elements are deallocated by the calling thread.
+  }
+  _map_unlock (m);
+  // The map can be used by other threads meanwhile.
+  if (!async || !first || !_map_reclaim (first, dtor, mappings)) {
+    _map_free_detached (&first, SIZE_MAX, dtor, mappings, pool);
+    if (destroy || copy)
+      _map_free_mappings (mappings);
+  }
+  if (journal)
+    _map_journal_sync (journal);
+  if (destroy)
+    _map_free_map (m);
   return 1;
 }
 
+size_t
+map_clear (map *m, void (*dtor) (void *)) {
+  size_t nb;
+  _map_clear (m, dtor, 0, 0, __func__, &nb);
+  return nb;
+}
+
+size_t
+map_clear_async (map *m, void (*dtor) (void *)) {
+  size_t nb;
+  _map_clear (m, dtor, 1, 0, __func__, &nb);
+  return nb;
+}
+
+int
+map_destroy_all (map *m, void (*dtor) (void *)) {
+  if (!m) {
+    errno = EINVAL;
+    return 0;
+  }
+  map_clear (m, dtor);
+  return map_destroy (m);
+}
+
+int
+map_destroy_async (map *m, void (*dtor) (void *)) {
+  size_t nb;
+  return _map_clear (m, dtor, 1, 1, __func__, &nb); // Once emptied, the map is destroyed unconditionally: it is never left without its mapped files.
+}
+
 size_t
 map_size (map *m) {
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   size_t ret = m->nb_elem;
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
   return ret;
 }
 
 size_t
 map_height (map *m) {
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   size_t ret = m->root ? m->root->height : 0;
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
   return ret;
 }
 
 size_t
 map_nb_balancing (map *m) {
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   size_t ret = m->nb_balancing;
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
   return ret;
 }
 
+int
+map_stats (map *m, struct map_stats *stats, int reset) {
+  if (!m || !stats) {
+    errno = EINVAL;
+    return 0;
+  }
+  _map_lock (m);
+  *stats = m->stats;
+  stats->overhead = sizeof (*m) + m->nb_elem * sizeof (*m->first);
+  stats->max_equal_keys = 0;
+  for (struct map_elem *h = m->first; h; h = h->next_gt) // Gauges are measured at the time of the call.
+    if (h->nb_equal > stats->max_equal_keys)
+      stats->max_equal_keys = h->nb_equal;
+  if (reset) // Counters only.
+    m->stats = (struct map_stats){ 0 };
+  _map_unlock (m);
+  return 1;
+}
+
+int
+map_lock_profile (map *m, FILE *stream, int reset) {
+  if (!m || !stream) {
+    errno = EINVAL;
+    return 0;
+  }
+#ifdef MAP_LOCK_PROFILING
+  struct map_lock_profile *p = malloc (sizeof (*p));
+  if (!p) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  _map_lock (m);
+  *p = m->profile; // Copied, to be displayed with the mutex unlocked.
+  if (reset) {
+    for (size_t i = 0; i < m->profile.nb_sites; i++)
+      m->profile.sites[i] = (struct map_lock_site){ .name = m->profile.sites[i].name };
+  }
+  _map_unlock (m);
+  fprintf (stream, "Lock profile of map %p:\n", (void *)m);
+  for (size_t i = 0; i < p->nb_sites; i++) {
+    const struct map_lock_site *site = &p->sites[i];
+    if (!site->nb_locks)
+      continue;
+    fprintf (stream, "  %s: %zu acquisitions, %llu ns waiting and %llu ns holding on average.\n", site->name, site->nb_locks,
+             site->wait_ns / site->nb_locks, site->hold_ns / site->nb_locks);
+    for (int hold = 0; hold <= 1; hold++) {
+      const size_t *histogram = hold ? site->hold : site->wait;
+      for (size_t k = 0; k < MAP_LOCK_PROFILE_BUCKETS; k++)
+        if (histogram[k])
+          fprintf (stream, "    %s %s %llu ns: %zu\n", hold ? "hold" : "wait", k ? "<" : "=", k ? 1ULL << k : 0ULL, histogram[k]);
+    }
+  }
+  free (p);
+  return 1;
+#else
+  (void)reset;
+  errno = ENOTSUP;
+  fprintf (stderr, "%s: %s\n", __func__, "Not compiled with MAP_LOCK_PROFILING defined.");
+  return 0;
+#endif
+}
+
 static struct map_elem *
 _map_previous_lt (struct map_elem *e) {
   struct map_elem *ret = e;
@@ -173,65 +829,35 @@ _map_next (struct map_elem *e) {
   return ret->next_gt;
 }
 
+// Maximum difference of heights between the two subtrees of a node before it gets rebalanced:
+// - 1 (by default) is the strict AVL criterion (lowest trees, more rotations) ;
+// - higher values relax the criterion (fewer rotations, higher trees) ;
+// - 0 disables balancing.
+#ifndef MAP_BALANCING_THRESHOLD
+#  define MAP_BALANCING_THRESHOLD 1
+#endif
+
+static size_t
+_map_height (const struct map_elem *e) {
+  return e ? e->height : 0;
+}
+
+// _map_set_height sets the height of a node from the heights of its children, and returns its previous height.
+static size_t
+_map_set_height (struct map_elem *e) {
+  size_t h = e->height;
+  size_t lh = _map_height (e->lt);
+  size_t gh = _map_height (e->gt);
+  e->height = (lh < gh ? gh : lh) + 1; // > 0
+  return h;
+}
+
 // _map_get_high MUST be called on a node every time one of its children (e->lt our e->gt) is modified.
 static void
 _map_get_high (struct map_elem *from) {
-  for (struct map_elem *e = from; e; e = e->upper) {
-    size_t h = e->height;
-    (void)h;
-    if (!e->lt && !e->gt)
-      e->height = 1; // > 0
-    else if (!e->lt)
-      e->height = e->gt->height + 1;
-    else if (!e->gt)
-      e->height = e->lt->height + 1;
-    else if (e->lt->height < e->gt->height)
-      e->height = e->gt->height + 1;
-    else
-      e->height = e->lt->height + 1;
-    if (e->height == h)
-      break;
-  }
-}
-
-static int
-_map_fold (struct map_elem *A) {
-  /*
-       A
-        \
-         B
-        /
-       C     =>   C
-                 / \
-                A   B
-  */
-  if (!A || A->height != 3 || (A->lt && A->gt) || (!A->lt && !A->gt))
-    return 0;
-  struct map_elem *B = A->lt ? A->lt : A->gt;
-  if ((B->lt && B->gt) || (!B->lt && !B->gt) || (A->gt && B->gt) || (A->lt && B->lt))
-    return 0;
-  struct map_elem *C = B->lt ? B->lt : B->gt;
-  if (C->lt || C->gt)
-    return 0;
-  struct map_elem *P = A->upper;
-  C->gt = A->gt ? A->gt : A;
-  C->lt = A->lt ? A->lt : A;
-  assert ((C->lt == A && C->gt == B) || (C->gt == A && C->lt == B));
-  A->lt = A->gt = B->lt = B->gt = 0;
-  A->upper = B->upper = C;
-  _map_get_high (A);
-  _map_get_high (B);
-  _map_get_high (C);
-  if ((C->upper = P)) {
-    if (P->lt == A)
-      P->lt = C;
-    else
-      P->gt = C;
-    _map_get_high (P);
-  } else
-    A->map->root = C;
-  A->map->nb_balancing++;
-  return 1;
+  for (struct map_elem *e = from; e; e = e->upper)
+    if (_map_set_height (e) == e->height)
+      break; // The upper nodes are not affected.
 }
 
 static void
@@ -263,11 +889,11 @@ _map_rotate_left (struct map_elem *A) {
       P->gt = B;
   } else
     A->map->root = B;
-  // NOTE: the height of B may have not changed but the height of its parent has (for instance if e and C are null).
-  _map_get_high (A);
-  _map_get_high (B);
-  _map_get_high (P);
+  // NOTE: the heights of A and B are updated, but not the height of P, which is left to the caller.
+  _map_set_height (A);
+  _map_set_height (B);
   A->map->nb_balancing++;
+  _map_probe2 (rotate__left, A->map, A->data);
 }
 
 static void
@@ -288,29 +914,101 @@ _map_rotate_right (struct map_elem *A) {
       P->lt = B;
   } else
     A->map->root = B;
-  _map_get_high (A);
-  _map_get_high (B);
-  _map_get_high (P);
+  _map_set_height (A);
+  _map_set_height (B);
   A->map->nb_balancing++;
+  _map_probe2 (rotate__right, A->map, A->data);
 }
 
+// _map_balance MUST be called, instead of _map_get_high, on the lowest node of which a child was added or removed.
+// It updates the heights of the nodes from 'from' upwards and rotates unbalanced nodes (with single or double rotations, as for AVL trees).
+// It stops as soon as the height of a subtree is unchanged, since the upper nodes are then not affected:
+// this assumes that they respect the balancing criterion, which does not hold for a splayed tree, or while rebalancing is deferred (see _map_balance_after_removal.)
 static void
 _map_balance (struct map_elem *from) {
-  static const size_t balancing_threashold = 1;
-  if (!balancing_threashold)
+  for (struct map_elem *e = from; e; e = e->upper) {
+    size_t h = _map_set_height (e);
+    size_t lh = _map_height (e->lt);
+    size_t gh = _map_height (e->gt);
+    if (MAP_BALANCING_THRESHOLD && lh > gh + MAP_BALANCING_THRESHOLD) {
+      if (_map_height (e->lt->gt) > _map_height (e->lt->lt))
+        _map_rotate_left (e->lt); // Double rotation
+      _map_rotate_right (e);
+      e = e->upper; // The new root of the subtree
+    } else if (MAP_BALANCING_THRESHOLD && gh > lh + MAP_BALANCING_THRESHOLD) {
+      if (_map_height (e->gt->lt) > _map_height (e->gt->gt))
+        _map_rotate_right (e->gt); // Double rotation
+      _map_rotate_left (e);
+      e = e->upper; // The new root of the subtree
+    }
+    if (e->height == h)
+      break;
+  }
+}
+
+// _map_splay semi-splays the node 'x' (as proposed by D. Sleator and R. Tarjan in 1985): the path from 'x' to the root is about halved, by pairs of nodes,
+// with one rotation for a zig-zig (the splaying then goes on from the parent of 'x') or two rotations for a zig-zag (it goes on from 'x'.)
+// It does about half the rotations of a full splaying, with the same amortized complexity (log n). Heights are kept up to date.
+static void
+_map_splay (struct map_elem *x) {
+  for (struct map_elem *P; (P = x->upper);) {
+    struct map_elem *G = P->upper;
+    if (!G) { // zig
+      if (x == P->lt)
+        _map_rotate_right (P);
+      else
+        _map_rotate_left (P);
+    } else if (x == P->lt && P == G->lt) { // zig-zig
+      _map_rotate_right (G);
+      x = P;
+    } else if (x == P->gt && P == G->gt) { // zig-zig
+      _map_rotate_left (G);
+      x = P;
+    } else if (x == P->gt) { // zig-zag
+      _map_rotate_left (P);
+      _map_rotate_right (G);
+    } else { // zig-zag
+      _map_rotate_right (P);
+      _map_rotate_left (G);
+    }
+  }
+}
+
+// _map_build links the elements heads[0] to heads[nb - 1], ordered by increasing keys, into a balanced tree, in linear time and without any comparison of keys.
+// The lists of equal elements hanging from the elements of heads are left untouched. The mutex of the map 'l' MUST be locked by the caller.
+static void
+_map_build (struct map *l, struct map_elem **heads, size_t nb) {
+  l->root = l->first = l->last = 0;
+  if (!nb)
     return;
-  for (struct map_elem *e = from; e;) {
-    struct map_elem *n = e->upper;
-    if (!_map_fold (e)) {
-      size_t lh = e->lt ? e->lt->height : 0;
-      size_t gh = e->gt ? e->gt->height : 0;
-      if (lh > gh + balancing_threashold)
-        _map_rotate_right (e);
-      else if (gh > lh + balancing_threashold)
-        _map_rotate_left (e);
+  // The middle element of a range is the root of its subtree. An explicit stack of ranges replaces recursion ; its depth is bounded by the height of the tree.
+  struct range {
+    size_t lo, hi;
+    struct map_elem *upper, **link;
+  } stack[2 * CHAR_BIT * sizeof (size_t)];
+  size_t top = 0;
+  stack[top++] = (struct range){ 0, nb, 0, &l->root };
+  while (top) {
+    struct range r = stack[--top];
+    if (r.lo == r.hi) {
+      *r.link = 0;
+      continue;
     }
-    e = n;
+    size_t mid = r.lo + (r.hi - r.lo) / 2;
+    struct map_elem *e = *r.link = heads[mid];
+    e->upper = r.upper;
+    e->height = 0; // The height of a subtree of k elements is the number of bits of k.
+    for (size_t k = r.hi - r.lo; k; k >>= 1)
+      e->height++;
+    stack[top++] = (struct range){ mid + 1, r.hi, e, &e->gt };
+    stack[top++] = (struct range){ r.lo, mid, e, &e->lt };
   }
+  for (size_t i = 0; i < nb; i++) {
+    heads[i]->previous_lt = i ? heads[i - 1] : 0;
+    heads[i]->next_gt = i + 1 < nb ? heads[i + 1] : 0;
+  }
+  l->first = heads[0];
+  l->last = heads[nb - 1]->eq_next ? heads[nb - 1]->eq_tail : heads[nb - 1];
 }
 
 void (*const SHAPE) (FILE *stream, const void *data) = (const void *)(&SHAPE);
@@ -376,7 +1074,8 @@ _map_scan_and_display (struct map_elem *root, FILE *stream, size_t indent, char
     fmapf (stream, ") ");
     assert (!root->eq_next || root != m->last);
     assert (!root->eq_next || (root->eq_tail && !root->eq_tail->eq_next && root->eq_tail->eq_head == root));
-    for (struct map_elem *eq = root->eq_next; eq; eq = eq->eq_next) {
+    size_t nb_equal = 1;
+    for (struct map_elem *eq = root->eq_next; eq; eq = eq->eq_next, nb_equal++) {
       assert (!eq->lt && !eq->gt);
       assert (eq->upper && eq->upper->eq_next == eq && (!eq->eq_next || eq->eq_next->upper == eq));
       assert (eq != m->first);
@@ -385,12 +1084,14 @@ _map_scan_and_display (struct map_elem *root, FILE *stream, size_t indent, char
       assert (eq->next_gt == 0);
       assert (eq->eq_next || (eq->eq_head == root && eq->eq_head->eq_tail == eq));
       assert (m->cmp_key && !m->cmp_key (root->key_from_data, eq->key_from_data, 0));
+      assert (!m->cmp_data || !m->cmp_data (root->data, eq->data, m->cmp_data_arg));
       fmapf (stream, "== '");
       displayer (stream, eq->data);
       fmapf (stream, "' (");
       fmapf (stream, "%s%s%s", eq == m->first ? "f" : "", eq == m->first && eq == m->last ? " ," : "", eq == m->last ? "l" : "");
       fmapf (stream, ") ");
     }
+    assert (root->nb_equal == nb_equal);
     fmapf (stream, "\n");
     assert (!root->gt || root->gt->upper == root);
     _map_scan_and_display (root->gt, stream, indent + 1, '<', displayer);
@@ -401,13 +1102,15 @@ _map_scan_and_display (struct map_elem *root, FILE *stream, size_t indent, char
     assert (!root->lt || root->height >= root->lt->height + 1);
     assert (!root->gt || root->height >= root->gt->height + 1);
     assert (!root->lt || !root->gt || root->height == root->lt->height + 1 || root->height == root->gt->height + 1);
+    assert (!MAP_BALANCING_THRESHOLD || root->map->splayed || root->map->unbalanced || // The balancing criterion
+            (_map_height (root->lt) <= _map_height (root->gt) + MAP_BALANCING_THRESHOLD && _map_height (root->gt) <= _map_height (root->lt) + MAP_BALANCING_THRESHOLD));
   } // if (root)
 }
 
 struct map *
 map_display (struct map *m, FILE *stream, void (*displayer) (FILE *stream, const void *data)) {
   fmapf (stream, "%'zu elements [%'zu]:\n", map_size (m), map_nb_balancing (m));
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   if (m->root) {
     _map_scan_and_display (m->root, stream, 0, '*', displayer);
     assert (!m->root->upper);
@@ -421,26 +1124,31 @@ map_display (struct map *m, FILE *stream, void (*displayer) (FILE *stream, const
     assert (!m->last->eq_head || !m->last->eq_head->gt);
   } else
     assert (!m->nb_elem && !m->first && !m->last);
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
   return m;
 }
 
-__attribute__ ((warn_unused_result)) int
-map_insert_data (struct map *l, void *data) {
-  if (!l) {
-    errno = EINVAL;
-    return 0;
-  }
-  struct map_elem *new = calloc (1, sizeof (*new)); // All attributes are set to 0.
-  if (!new) {
-    errno = ENOMEM;
-    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
-    return 0;
-  }
-  new->data = data;
-  new->map = l;
-  mtx_lock (&l->mutex);
+// _map_pending tells if an element of the map 'l' which key was changed in place (MAP_REKEY), and not yet relinked, has a key equal to 'key'.
+// Those elements are still in the map as far as its unicity constraint is concerned. The mutex of 'l' MUST be locked by the caller.
+static int
+_map_pending (struct map *l, const void *key) {
+  for (struct map_elem *e = l->rekeyed; e; e = e->eq_next)
+    if ((l->stats.nb_comparisons++, l->cmp_key (key, l->get_key (e->data), l->cmp_arg)) == 0)
+      return 1;
+  return 0;
+}
+
+// _map_link links the (allocated) element 'new' into the map 'l'. The mutex of 'l' MUST be locked by the caller.
+// All the links of 'new' are (re)initialised: the element can be a newly allocated one or one just unlinked from another map.
+// Returns 0 (and errno set to EPERM) if 'new' is not linked into 'l' because of the unicity constraint, 1 otherwise.
+static int
+_map_link (struct map *l, struct map_elem *new) {
+  *new = (struct map_elem){ .data = new->data, .map = l, .nb_equal = 1 }; // All links are reset to 0.
   new->key_from_data = l->get_key ? l->get_key (new->data) : 0; // The key is evaluated only once, at insertion.
+  if (l->uniqueness && l->rekeyed && _map_pending (l, new->key_from_data)) {
+    errno = EPERM;
+    return 0; // new is not inserted.
+  }
   struct map_elem *iter;
   int cmp, is_last;
   is_last = 1;
@@ -450,8 +1158,10 @@ map_insert_data (struct map *l, void *data) {
     (l->last->gt = new)->upper = l->last;
     l->last = new;
   } else
-    while (1)
-      if ((cmp = l->cmp_key ? l->cmp_key (new->key_from_data, iter->key_from_data, l->cmp_arg) : 0) < 0) {
+    while (1) {
+      if ((cmp = (l->stats.nb_comparisons++, l->cmp_key (new->key_from_data, iter->key_from_data, l->cmp_arg))) == 0 && l->cmp_data)
+        cmp = l->cmp_data (new->data, iter->data, l->cmp_data_arg); // Elements of equal keys are ordered by the secondary comparator, if set.
+      if (cmp < 0) {
         is_last = 0;
         if (iter->lt)
           iter = iter->lt;
@@ -462,19 +1172,17 @@ map_insert_data (struct map *l, void *data) {
         }
       } else if (l->uniqueness && cmp == 0) {
         errno = EPERM;
-        free (new); // new is not inserted.
-        new = 0;    // invalidate insertion.
-        break;
+        return 0; // new is not inserted.
       } else if (cmp == 0) // && !l->uniqueness
       {
         new->eq_head = iter;
+        iter->nb_equal++;
         if (iter->eq_next)
           iter = iter->eq_tail; // Insert at the tail
         new->eq_head->eq_tail = new;
         if (((iter->eq_next = new)->upper = iter) == l->last)
           l->last = new;
         l->nb_elem++;
-        mtx_unlock (&l->mutex);
         return 1;
       } else if (iter->gt) // && cmp > 0
         iter = iter->gt;
@@ -485,25 +1193,106 @@ map_insert_data (struct map *l, void *data) {
           l->last = new;
         break;
       }
-  if (new) {
-    if ((new->next_gt = _map_next_gt (new)))
-      new->next_gt->previous_lt = new;
-    if ((new->previous_lt = _map_previous_lt (new)))
-      new->previous_lt->next_gt = new;
-    l->nb_elem++;
-    _map_get_high (new);
-    _map_get_high (iter);
-    _map_balance (new);
+    }
+  if ((new->next_gt = _map_next_gt (new)))
+    new->next_gt->previous_lt = new;
+  if ((new->previous_lt = _map_previous_lt (new)))
+    new->previous_lt->next_gt = new;
+  l->nb_elem++;
+  _map_balance (new);
+  return 1;
+}
+
+__attribute__ ((warn_unused_result)) int
+map_insert_data (struct map *l, void *data) {
+  if (!l) {
+    errno = EINVAL;
+    return 0;
+  }
+  struct map_elem *new = _map_alloc (l); // All attributes are set to 0.
+  if (!new) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
   }
-  mtx_unlock (&l->mutex);
-  return new ? 1 : 0;
+  new->data = data;
+  _map_probe2 (insert__entry, l, data);
+  _map_lock (l);
+  l->stats.nb_insertions++;
+  l->stats.nb_allocations++;
+  int ret = _map_link (l, new);
+  if (ret && l->journal)
+    _map_journal_data (l, 0, data);
+  struct map_journal *journal = ret && !l->traversing ? l->journal : 0; // Inside a traversal, the journal is synchronised at the end of the traversal.
+  _map_unlock (l);
+  if (!ret)
+    _map_free (l->pool, new); // new is not inserted.
+  else if (journal)
+    _map_journal_sync (journal);
+  _map_probe3 (insert__return, l, data, ret);
+  return ret;
 }
 
+// While a map is being traversed (by _map_traverse or _map_find_key), the first removals are rebalanced one by one.
+// Once a rebuild of the tree, in linear time, costs less than rebalancing the removals made so far (about log n each), rebalancing is deferred
+// till the end of the traversal, where the tree is rebuilt (see _map_rebalance.)
+// The tree remains a valid (but possibly unbalanced) binary search tree meanwhile, heights being kept up to date.
+static void
+_map_balance_after_removal (struct map *l, struct map_elem *from) {
+  if (!l->traversing || !MAP_BALANCING_THRESHOLD) {
+    _map_balance (from);
+    return;
+  }
+  size_t log2 = 1;
+  for (size_t n = l->nb_elem; n >>= 1;)
+    log2++;
+  if (!l->unbalanced && ++l->nb_rebalanced * log2 < l->nb_elem)
+    _map_balance (from);
+  else {
+    _map_get_high (from);
+    l->unbalanced = 1;
+  }
+}
+
+// _map_rebalance is called at the end of the outermost traversal of a map.
+// If the rebalancing of removals was deferred, the tree is rebuilt, once, in linear time, and respects the balancing criterion again.
+static void
+_map_rebalance (struct map *l) {
+  l->nb_rebalanced = 0;
+  if (!l->unbalanced)
+    return;
+  size_t nb = 0;
+  for (struct map_elem *h = l->first; h; h = h->next_gt)
+    nb++;
+  struct map_elem **heads = malloc ((nb ? nb : 1) * sizeof (*heads));
+  if (!heads)
+    return; // The tree remains valid, though unbalanced, till the end of the next traversal.
+  nb = 0;
+  for (struct map_elem *h = l->first; h; h = h->next_gt)
+    heads[nb++] = h;
+  _map_build (l, heads, nb);
+  free (heads);
+  l->unbalanced = 0;
+  l->stats.nb_rebuilds++; // Not a rotation (see map_nb_balancing.)
+}
+
+// _map_head returns the head of the equal elements of 'e', walking up its list of equal elements, in the number of elements before 'e' in the list.
+// Traversals and finds keep track of the head instead, and only call _map_head if an operator has unlinked elements by nested calls (the head might be one of them.)
+static struct map_elem *
+_map_head (struct map_elem *e) {
+  while (e->upper && e->upper->eq_next == e)
+    e = e->upper;
+  return e;
+}
+
+// _map_unlink unlinks the element 'old' from its map, without deallocating it. The mutex of the map MUST be locked by the caller.
+// 'head' is the head of the equal elements of 'old' ('old' itself if it is the head), which counts them: the callers know it, as they have walked down to 'old'.
 static void *
-_map_remove (struct map_elem *old) {
+_map_unlink (struct map_elem *old, struct map_elem *head) {
   struct map_elem *e = old;
   struct map *l = e->map;
   void *data = e->data;
+  l->nb_unlinked++;
 
   if (l->first == e)
     l->first = _map_next (e);
@@ -512,6 +1301,7 @@ _map_remove (struct map_elem *old) {
 
   if (e->upper && e->upper->eq_next == e) // e is not the head of equal elements
   {
+    head->nb_equal--;
     if (e->eq_next) // e is not the tail of equal elements
       e->eq_next->upper = e->upper;
     else // e is the tail of equal elements
@@ -548,6 +1338,7 @@ _map_remove (struct map_elem *old) {
     if (e->next_gt)
       e->next_gt->previous_lt = e->eq_next;
     e->eq_next->height = e->height;
+    e->eq_next->nb_equal = e->nb_equal - 1;
   } else if (e->lt && e->gt) {
     /* Makes use of the method proposed by T. Hibbard in 1962:
        swap the node to be deleted with its successor or predecessor.
@@ -581,7 +1372,6 @@ _map_remove (struct map_elem *old) {
       hibbard62->upper->lt = child;
     else if (hibbard62->upper->gt == hibbard62)
       hibbard62->upper->gt = child;
-    _map_get_high (hibbard62->upper);
     if (child)
       child->upper = hibbard62->upper;
     // Here, nobody points to hibbard62 anymore.
@@ -592,7 +1382,7 @@ _map_remove (struct map_elem *old) {
     if (e->lt)
       e->lt->upper = hibbard62;
     hibbard62->gt = e->gt;
-    _map_get_high (hibbard62);
+    hibbard62->height = e->height; // The former height of the subtree, updated below from 'invalidated' upwards.
     if (e->gt)
       e->gt->upper = hibbard62;
     if (e->upper) {
@@ -602,11 +1392,10 @@ _map_remove (struct map_elem *old) {
         e->upper->gt = hibbard62;
     } else
       l->root = hibbard62;
-    _map_get_high (e->upper);
     // Here, some nodes point to hibbard62 again.
     // Here, no node points to e anymore.
     // Invalidate the modified node
-    _map_balance (invalidated);
+    _map_balance_after_removal (l, invalidated);
   } // if (e->lt && e->gt)
   else // if (!e->lt || !e->gt)
   {
@@ -624,38 +1413,190 @@ _map_remove (struct map_elem *old) {
       e->upper->lt = child;
     else if (e == e->upper->gt) // (e == e->upper->gt)
       e->upper->gt = child;
-    _map_get_high (e->upper);
-    _map_balance (e->upper); // One (and only one) of the children of the parent has changed.
+    _map_balance_after_removal (l, e->upper); // One (and only one) of the children of the parent has changed.
   } // if (!e->lt || !e->gt)
-  free (old);
   l->nb_elem--;
   return data;
 }
 
+static void *
+_map_remove (struct map_elem *old, struct map_elem *head) {
+  struct map *l = old->map;
+  l->stats.nb_removals++;
+  _map_probe2 (remove, l, old->data);
+  void *data = _map_unlink (old, head);
+  _map_free (l->pool, old);
+  return data;
+}
+
+// _map_lookup returns the element of the map 'l' which key is equal to 'key' (the head of equal elements), or 0 if none. The mutex of 'l' MUST be locked by the caller.
+// If the map has a secondary comparator, several heads can have keys equal to 'key' (one per group of equal data for the secondary comparator): the first one in order is returned
+// or, if 'data' is not null, the one of data equal to 'data' for the secondary comparator.
+static struct map_elem *
+_map_lookup (struct map *l, const void *key, const void *data) {
+  struct map_elem *iter = l->root, *first = 0;
+  int cmp;
+  while (iter)
+    if ((cmp = (l->stats.nb_comparisons++, l->cmp_key (key, iter->key_from_data, l->cmp_arg))) == 0 && l->cmp_data && !data) {
+      first = iter; // Lower ones might be equal too.
+      iter = iter->lt;
+    } else if (cmp == 0 && (!l->cmp_data || (cmp = l->cmp_data (data, iter->data, l->cmp_data_arg)) == 0))
+      return iter;
+    else
+      iter = cmp < 0 ? iter->lt : iter->gt;
+  return first;
+}
+
+// _map_move transplants the element 'e' (with its data) from its map to the map 'to', without any reallocation. The mutex of the map of 'e' MUST be locked by the caller.
+// Between maps of distinct pools (see map_create_shared), the element is reallocated from the pool of 'to' instead, and 'e' is deallocated.
+// 'head' is the head of the equal elements of 'e' (see _map_unlink).
+// Returns 1 if the element was moved, 0 otherwise (and errno set to EPERM if the element does not respect the unicity constraint of the destination map 'to',
+// or to ENOMEM if the element could not be reallocated.)
+static int
+_map_move (struct map_elem *e, struct map_elem *head, struct map *to) {
+  int ret = 0;
+  _map_lock (to);
+  struct map *from = e->map;
+  struct map_elem *moved = 0;
+  if (to->uniqueness && (_map_lookup (to, to->get_key (e->data), 0) || _map_pending (to, to->get_key (e->data))))
+    errno = EPERM; // Elements that do not respect the unicity constraint of the destination map will not be moved and will remain in the source map.
+  else if (!(moved = from->pool == to->pool ? e : _map_alloc (to))) {
+    errno = ENOMEM; // The element remains in the source map.
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+  } else {
+    if (moved != e) {
+      moved->data = e->data;
+      to->stats.nb_allocations++;
+    }
+    _map_unlink (e, head);
+    if (from->journal)
+      _map_journal_data (from, 1, e->data);
+    if (moved != e)
+      _map_free (from->pool, e);
+    ret = _map_link (to, moved); // The unicity constraint has already been checked: _map_link cannot fail here.
+    if (to->journal)
+      _map_journal_data (to, 0, moved->data);
+  }
+  _map_unlock (to);
+  return ret;
+}
+
+// _map_key_taken tells if the key of 'e', just changed in place, is already the key of another element of the map 'l' (with unicity constraint.)
+// 'e' is still linked at its former position: its subtrees are told apart by its predecessor, the greatest element of its left subtree.
+static int
+_map_key_taken (struct map *l, struct map_elem *e) {
+  const void *key = l->get_key (e->data);
+  for (struct map_elem *iter = l->root; iter;) {
+    int cmp;
+    if (iter == e)
+      iter = e->lt && (l->stats.nb_comparisons++, l->cmp_key (key, e->previous_lt->key_from_data, l->cmp_arg)) <= 0 ? e->lt : e->gt;
+    else if ((cmp = (l->stats.nb_comparisons++, l->cmp_key (key, iter->key_from_data, l->cmp_arg))) == 0)
+      return 1;
+    else
+      iter = cmp < 0 ? iter->lt : iter->gt;
+  }
+  return _map_pending (l, key);
+}
+
+// _map_rekey handles the element 'e' which key was just changed in place by the operator 'op' (with *remove set to MAP_REKEY.) The mutex of 'l' MUST be locked by the caller.
+// The element is unlinked, to be relinked at the end of the outermost traversal (see _map_relink), and MAP_REKEY is returned.
+// If the new key is already in the map (with unicity constraint), the change is refused (with errno set to EPERM): 'op' is called again on 'e', with *remove set to MAP_REKEY,
+// to restore the former key (the element then stays in place and 0 is returned) or to set *remove to 1 (the value returned, the element having to be removed by the caller.)
+static int
+_map_rekey (struct map *l, struct map_elem *e, struct map_elem *head, map_operator op, void *op_arg, const struct map_kept *kept) {
+  if (l->uniqueness && _map_key_taken (l, e)) {
+    errno = EPERM;
+    int remove = MAP_REKEY;
+    op (e->data, op_arg, &remove, l->context);
+    return remove == MAP_REKEY ? 0 : remove;
+  }
+  _map_journal_kept (l, kept);
+  _map_unlink (e, head);
+  e->eq_next = l->rekeyed;
+  l->rekeyed = e;
+  return MAP_REKEY;
+}
+
+// _map_relink links back into the map 'l' the elements which keys were changed in place, at the end of the outermost traversal (or find):
+// they are therefore neither traversed nor found twice, even by an enclosing traversal. They are relinked at their new position without any reallocation.
+// The mutex of 'l' MUST be locked by the caller.
+static void
+_map_relink (struct map *l) {
+  struct map_elem *rekeyed = l->rekeyed;
+  l->rekeyed = 0;
+  for (struct map_elem *e = rekeyed, *next; e; e = next) {
+    next = e->eq_next;
+    if (_map_link (l, e) && l->journal) // Can not fail: the unicity constraint was checked by _map_rekey, and by insertions meanwhile.
+      _map_journal_data (l, 0, e->data);
+  }
+}
+
+// _map_unlock_and_sync unlocks the map 'l' at the end of a traversal (or find), and then synchronises the journals of 'l' and 'to' (destination of MAP_MOVE_TO), if any.
+// Journals are not synchronised at the end of traversals nested in an operator, but at the end of the outermost traversal.
+static void
+_map_unlock_and_sync (struct map *l, struct map *to) {
+  struct map_journal *journal = !l->traversing ? l->journal : 0;
+  struct map_journal *to_journal = 0;
+  if (to) {
+    _map_lock (to);
+    to_journal = !to->traversing ? to->journal : 0;
+    _map_unlock (to);
+  }
+  _map_unlock (l);
+  if (journal)
+    _map_journal_sync (journal);
+  if (to_journal && to_journal != journal)
+    _map_journal_sync (to_journal);
+}
+
 static size_t
 _map_traverse (map *m, map_operator op, void *op_arg, map_selector sel, void *sel_arg, int backward) {
   if (!m) {
     errno = EINVAL;
     return 0;
   }
-  mtx_lock (&m->mutex);
+  _map_probe2 (traverse__entry, m, backward);
+  _map_lock (m);
+  m->stats.nb_traversals++;
+  m->traversing++;
   size_t nb_op = 0;
-  for (struct map_elem *e = backward ? m->last : m->first; e;) {
+  struct map_kept kept = { 0 };
+  for (struct map_elem *e = backward ? m->last : m->first, *head = 0; e;) {
     struct map_elem *n = backward ? _map_previous (e) : _map_next (e);
+    if (!e->upper || e->upper->eq_next != e) // e is the head of equal elements
+      head = e;
+    else if (!e->eq_next) // e is the tail, which knows its head. Otherwise, the head (forward) or the tail (backward) of e has been traversed before e.
+      head = e->eq_head;
+    size_t nb_unlinked = m->nb_unlinked;
     int remove = 0;
+    int move = op == MAP_MOVE_TO && op_arg;
     int go_on = 1;
     if (!sel || sel (e->data, sel_arg, m->context)) {
-      if (op && ((go_on = op (e->data, op_arg, &remove, m->context))))
+      if (move)
+        _map_move (e, head, op_arg); // The element is transplanted, without reallocation (unless into another pool.) It must not be accessed anymore.
+      else if (op && (_map_journal_keep (m, &kept, e->data), (go_on = op (e->data, op_arg, &remove, m->context))))
         n = backward ? _map_previous (e) : _map_next (e); // Updated, after op has been called (an added equal element while traversing might be traversed later.)
       nb_op++;
-      if (remove)
-        _map_remove (e);
+      if (!move && m->nb_unlinked != nb_unlinked) // The operator has unlinked elements by nested calls, maybe the head of e.
+        head = _map_head (e);
+      if (remove == MAP_REKEY)
+        remove = _map_rekey (m, e, head, op, op_arg, &kept); // The element is relinked at the end of the traversal, and therefore not traversed twice.
+      if (remove && remove != MAP_REKEY) {
+        _map_journal_kept (m, &kept);
+        _map_remove (e, head);
+      }
       if (!go_on)
         break;
     }
     e = n;
   }
-  mtx_unlock (&m->mutex);
+  if (!--m->traversing) {
+    _map_rebalance (m);
+    _map_relink (m);
+  }
+  free (kept.bytes);
+  _map_unlock_and_sync (m, op == MAP_MOVE_TO ? op_arg : 0);
+  _map_probe2 (traverse__return, m, nb_op);
   return nb_op;
 }
 
@@ -669,9 +1610,10 @@ map_traverse_backward (map *m, map_operator op, void *op_arg, map_selector sel,
   return _map_traverse (m, op, op_arg, sel, sel_arg, 1);
 }
 
+// _map_find_key applies 'op' on the elements of key equal to 'key' (and of data equal to 'data' for the secondary comparator of the map, if both are set.)
 static size_t
-_map_find_key (struct map *l, struct map_elem *from, const void *key, map_operator op, void *op_arg, map_selector sel, void *sel_arg) {
-  if (!l || !key || (from && from->map != l)) {
+_map_find_key (struct map *l, const void *key, const void *data, map_operator op, void *op_arg, map_selector sel, void *sel_arg) {
+  if (!l || !key) {
     errno = EINVAL;
     return 0;
   }
@@ -680,33 +1622,95 @@ _map_find_key (struct map *l, struct map_elem *from, const void *key, map_operat
     errno = EPERM;
     return 0;
   }
-  mtx_lock (&l->mutex);
+  _map_probe2 (find__entry, l, key);
+  _map_lock (l);
+  l->stats.nb_finds++;
+  l->traversing++;
   size_t nb_op = 0;
-  int cmp_key;
-  struct map_elem *iter = from; // l->root;
-  while (iter)
-    if ((cmp_key = l->cmp_key (key, iter->key_from_data, l->cmp_arg)) < 0)
-      iter = iter->lt;
-    else if (cmp_key == 0) {
-      int remove = 0;
-      int go_on = 1;
-      if (!sel || sel (iter->data, sel_arg, l->context)) {
-        go_on = op ? op (iter->data, op_arg, &remove, l->context) : 1;
-        nb_op++;
+  struct map_kept kept = { 0 };
+  struct map_elem *head = _map_lookup (l, key, data);
+  if (head && l->splaying) {
+    _map_splay (head);
+    l->splayed = 1;
+  }
+  for (struct map_elem *iter = head; iter;) {
+    size_t nb_unlinked = l->nb_unlinked;
+    int remove = 0;
+    int move = 0;
+    int go_on = 1;
+    if (!sel || sel (iter->data, sel_arg, l->context)) {
+      if (op == MAP_MOVE_TO && op_arg)
+        move = 1;
+      else if (op) {
+        _map_journal_keep (l, &kept, iter->data);
+        go_on = op (iter->data, op_arg, &remove, l->context);
       }
-      struct map_elem *next = go_on ? iter->eq_next : 0; // After op is called. An added equal element while finding will be found later.
-      if (remove)
-        _map_remove (iter);
-      iter = next;
-    } else // cmp_key > 0
-      iter = iter->gt;
-  mtx_unlock (&l->mutex);
+      nb_op++;
+    }
+    if (l->nb_unlinked != nb_unlinked) // The operator has unlinked elements by nested calls, maybe the head of iter.
+      head = _map_head (iter);
+    struct map_elem *next = go_on ? iter->eq_next : 0; // After op is called. An added equal element while finding will be found later.
+    if (go_on && !next && l->cmp_data && !data && (next = head->next_gt) && (l->stats.nb_comparisons++, l->cmp_key (key, next->key_from_data, l->cmp_arg)))
+      next = 0; // The next head is the first one of a greater key.
+    struct map_elem *eq_next = iter->eq_next;
+    if (remove == MAP_REKEY)
+      remove = _map_rekey (l, iter, head, op, op_arg, &kept); // The element is relinked at the end of the find, and therefore not found twice.
+    int gone = remove != 0;
+    if (remove && remove != MAP_REKEY) {
+      _map_journal_kept (l, &kept);
+      _map_remove (iter, head);
+    } else if (move)
+      gone = _map_move (iter, head, op_arg); // The element is transplanted, without reallocation (unless it breaks the unicity constraint of the destination.)
+    if (gone && iter == head)
+      head = eq_next; // The next equal element has replaced the head in the tree.
+    if (next && next != eq_next)
+      head = next;
+    iter = next;
+  }
+  if (!--l->traversing) {
+    _map_rebalance (l);
+    _map_relink (l);
+  }
+  free (kept.bytes);
+  _map_unlock_and_sync (l, op == MAP_MOVE_TO ? op_arg : 0);
+  _map_probe3 (find__return, l, key, nb_op);
   return nb_op;
 }
 
 size_t
 map_find_key (struct map *l, const void *key, map_operator op, void *op_arg, map_selector sel, void *sel_arg) {
-  return _map_find_key (l, l->root, key, op, op_arg, sel, sel_arg);
+  return _map_find_key (l, key, 0, op, op_arg, sel, sel_arg);
+}
+
+size_t
+map_find_data (map *m, const void *data, map_operator op, void *op_arg) {
+  if (!m || !data) {
+    errno = EINVAL;
+    return 0;
+  }
+  return _map_find_key (m, m->get_key ? m->get_key ((void *)data) : data, data, op, op_arg, 0, 0);
+}
+
+size_t
+map_count_key (map *m, const void *key) {
+  if (!m || !key) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (!m->cmp_key) {
+    fprintf (stderr, "%s: %s\n", __func__, "Undefined key comparator.");
+    errno = EPERM;
+    return 0;
+  }
+  _map_lock (m);
+  size_t nb = 0;
+  for (struct map_elem *head = _map_lookup (m, key, 0); head; head = head->next_gt) {
+    nb += head->nb_equal;
+    if (!m->cmp_data || !head->next_gt || (m->stats.nb_comparisons++, m->cmp_key (key, head->next_gt->key_from_data, m->cmp_arg)))
+      break; // Only with a secondary comparator can the following heads have equal keys too.
+  }
+  _map_unlock (m);
+  return nb;
 }
 
 size_t
@@ -721,20 +1725,802 @@ map_traverse_keys (map *m, map_operator_on_key op, void *op_arg) {
     return 0;
   }
 
-  mtx_lock (&m->mutex);
+  _map_lock (m);
   size_t nb_op = 0;
-  for (struct map_elem *e = m->first; e; e = e->next_gt) {
-    if (op) {
-      const void *key = m->get_key (e->data);
-      size_t nb = _map_find_key (m, e /* Straight to the point. */, key, 0, 0, 0, 0); // Counting the number of entries in a multimap for the key.
-      op (key, nb, op_arg, m->context);
-    }
+  for (struct map_elem *e = m->first, *next; e; e = next) { // A single pass on the heads of equal elements, which know their number.
+    size_t nb = e->nb_equal;
+    for (next = e->next_gt; m->cmp_data && next && !(m->stats.nb_comparisons++, m->cmp_key (e->key_from_data, next->key_from_data, m->cmp_arg)); next = next->next_gt)
+      nb += next->nb_equal; // With a secondary comparator, consecutive heads can have equal keys.
+    if (op)
+      op (e->key_from_data, nb, op_arg, m->context); // The key was extracted at insertion.
     nb_op++;
   }
-  mtx_unlock (&m->mutex);
+  _map_unlock (m);
   return nb_op;
 }
 
+size_t
+map_merge_keys (map *m, const void *old_key, const void *new_key, void (*relabel) (void *arg), void *arg) {
+  if (!m || !old_key || !new_key) {
+    errno = EINVAL;
+    return 0;
+  }
+  _map_lock (m);
+  if (!m->cmp_key || m->uniqueness || m->cmp_data || m->journal || m->traversing) {
+    _map_unlock (m);
+    fprintf (stderr, "%s: %s\n", __func__, "Not a map of keys with duplicates, without secondary comparator nor journal, nor being traversed.");
+    errno = EPERM;
+    return 0;
+  }
+  struct map_elem *from = _map_lookup (m, old_key, 0), *to = _map_lookup (m, new_key, 0);
+  size_t nb = 0;
+  if (from && to && from != to) {
+    struct map_elem *rest = from->eq_next, *tail = rest ? from->eq_tail : from;
+    struct map_elem *to_tail = to->eq_next ? to->eq_tail : to;
+    struct map_elem *previous = from->previous_lt; // Not 0 if 'from' is last, since the key of 'to' is then lower.
+    int from_last = m->last == tail, to_last = m->last == to_tail;
+    nb = from->nb_equal;
+    from->eq_next = from->eq_head = 0; // The head 'from' is unlinked from the tree alone, its list of equal elements being kept aside.
+    _map_unlink (from, from);
+    m->nb_elem++;
+    // The list of 'from' is appended to the list of 'to'.
+    *from = (struct map_elem){ .data = from->data, .key_from_data = from->key_from_data, .map = m, .upper = to_tail, .eq_next = rest };
+    to_tail->eq_next = from;
+    (to->eq_tail = tail)->eq_head = to;
+    to->nb_equal += nb;
+    if (to_last || (from_last && previous == to))
+      m->last = tail;
+    else if (from_last)
+      m->last = previous->eq_next ? previous->eq_tail : previous;
+    if (relabel)
+      relabel (arg); // The keys of the moved elements are made equal to 'new_key' before the map is unlocked.
+  }
+  _map_unlock (m);
+  return nb;
+}
+
+map *
+map_snapshot (map *m) {
+  if (!m) {
+    errno = EINVAL;
+    return 0;
+  }
+  _map_lock (m);
+  struct map *s = map_create (m->get_key, m->cmp_key, m->cmp_arg, m->uniqueness);
+  if (s) {
+    s->cmp_data = m->cmp_data;
+    s->cmp_data_arg = m->cmp_data_arg;
+  }
+  if (s && m->mappings && !(s->mappings = _map_copy_mappings (m->mappings))) { // The files mapped by map_load_mmap are shared with the snapshot.
+    map_destroy (s);
+    s = 0;
+  }
+  size_t nb_heads = 0;
+  for (struct map_elem *h = m->first; h; h = h->next_gt)
+    nb_heads++;
+  struct map_elem **heads = s ? malloc ((nb_heads ? nb_heads : 1) * sizeof (*heads)) : 0;
+  size_t nb = 0;
+  // The elements of m are copied in order: distinct keys as heads, equal keys in lists hanging from their heads.
+  for (struct map_elem *h = m->first; heads && h; h = h->next_gt) {
+    struct map_elem *tail = heads[nb] = calloc (1, sizeof (*tail));
+    if (!tail)
+      break;
+    *tail = (struct map_elem){ .data = h->data, .key_from_data = h->key_from_data, .map = s, .nb_equal = h->nb_equal };
+    nb++;
+    for (struct map_elem *eq = h->eq_next; eq && tail; eq = eq->eq_next) {
+      struct map_elem *new = calloc (1, sizeof (*new));
+      if (new) {
+        *new = (struct map_elem){ .data = eq->data, .key_from_data = eq->key_from_data, .map = s, .upper = tail };
+        (tail->eq_next = new)->eq_head = heads[nb - 1];
+        heads[nb - 1]->eq_tail = new;
+      }
+      tail = new;
+    }
+    if (!tail)
+      break;
+  }
+  if (!heads || nb < nb_heads) {
+    for (size_t i = 0; heads && i < nb; i++)
+      for (struct map_elem *e = heads[i], *next; e; e = next) {
+        next = e->eq_next;
+        free (e);
+      }
+    free (heads);
+    if (s)
+      map_destroy (s);
+    _map_unlock (m);
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  _map_build (s, heads, nb);
+  s->nb_elem = s->stats.nb_allocations = m->nb_elem;
+  if (m->context != m)
+    s->context = m->context;
+  _map_unlock (m);
+  free (heads);
+  return s;
+}
+
+int
+map_transaction (map *maps[], size_t nb_maps, int (*op) (void *op_arg), void *op_arg) {
+  if (!op || (nb_maps && !maps)) {
+    errno = EINVAL;
+    return 0;
+  }
+  map *buffer[16];
+  map **locked = nb_maps <= sizeof (buffer) / sizeof (*buffer) ? buffer : malloc (nb_maps * sizeof (*locked));
+  if (!locked) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  // The maps are sorted by address (insertion sort), which defines the canonical order of locking. Null and repeated maps are discarded.
+  size_t nb_locked = 0;
+  for (size_t i = 0; i < nb_maps; i++) {
+    if (!maps[i])
+      continue;
+    size_t j = nb_locked;
+    while (j && (uintptr_t)locked[j - 1] > (uintptr_t)maps[i])
+      j--;
+    if (j && locked[j - 1] == maps[i])
+      continue;
+    memmove (locked + j + 1, locked + j, (nb_locked - j) * sizeof (*locked));
+    locked[j] = maps[i];
+    nb_locked++;
+  }
+  for (size_t i = 0; i < nb_locked; i++)
+    _map_lock (locked[i]);
+  int ret = op (op_arg);
+  for (size_t i = nb_locked; i > 0; i--)
+    _map_unlock (locked[i - 1]);
+  if (locked != buffer)
+    free (locked);
+  return ret;
+}
+
+// Format of a dump (in the native byte order and alignment of the machine):
+// - a header: MAP_DUMP_MAGIC (8 bytes), version, number of elements (as 64-bit integers), padded to MAP_DUMP_ALIGNMENT bytes ;
+// - a record per element, in the order of the map: size of the serialized data, flags (64-bit integers), and serialized data, padded to MAP_DUMP_ALIGNMENT bytes.
+// The alignment of records allows the use of serialized data in place, as mapped in memory.
+static const char MAP_DUMP_MAGIC[8] = "MAPDUMP";
+static const uint64_t MAP_DUMP_VERSION = 1;
+#define MAP_DUMP_ALIGNMENT ((size_t)16)
+#define MAP_DUMP_PADDED(size) (((size) + MAP_DUMP_ALIGNMENT - 1) / MAP_DUMP_ALIGNMENT * MAP_DUMP_ALIGNMENT)
+static const uint64_t MAP_DUMP_EQUAL_KEY = 1; // Flag: the key of the element is equal to the key of the previous element.
+
+struct map_dump_header {
+  char magic[sizeof (MAP_DUMP_MAGIC)];
+  uint64_t version;
+  uint64_t nb_elem;
+  uint64_t generation; // Generation of the journal which follows the dump (see map_checkpoint)
+};
+
+struct map_dump_record {
+  uint64_t size;
+  uint64_t flags;
+};
+
+struct map_writer {
+  int fd;
+  size_t used;
+  char buffer[64 * 1024];
+};
+
+static int
+_map_write (struct map_writer *w, const void *bytes, size_t size) {
+  if (w->used + size > sizeof (w->buffer) || !bytes) // Flush (a null 'bytes' forces the flush.)
+    for (size_t done = 0; done < w->used;) {
+      ssize_t ret = write (w->fd, w->buffer + done, w->used - done);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return 0;
+      done += (size_t)ret;
+    }
+  if (w->used + size > sizeof (w->buffer) || !bytes)
+    w->used = 0;
+  if (!bytes)
+    return 1;
+  if (size > sizeof (w->buffer)) { // Large data is written directly.
+    for (size_t done = 0; done < size;) {
+      ssize_t ret = write (w->fd, (const char *)bytes + done, size - done);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return 0;
+      done += (size_t)ret;
+    }
+    return 1;
+  }
+  memcpy (w->buffer + w->used, bytes, size);
+  w->used += size;
+  return 1;
+}
+
+// _map_dump returns the number of elements written and sets *ok to 0 on failure (with errno set), 1 otherwise.
+// The dump is stamped with '*generation', or with the generation of 'm' read under its mutex if 'generation' is null.
+static size_t
+_map_dump (map *m, int fd, map_serializer serializer, const uint64_t *generation, int *ok) {
+  *ok = 0;
+  if (!m || !serializer || fd < 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  struct map_writer *w = malloc (sizeof (*w));
+  if (!w) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  w->fd = fd;
+  w->used = 0;
+  static const char padding[MAP_DUMP_ALIGNMENT] = { 0 };
+  _map_lock (m);
+  struct map_dump_header header = { .version = MAP_DUMP_VERSION, .nb_elem = m->nb_elem, .generation = generation ? *generation : m->generation };
+  memcpy (header.magic, MAP_DUMP_MAGIC, sizeof (header.magic));
+  *ok = _map_write (w, &header, sizeof (header)) && _map_write (w, padding, MAP_DUMP_PADDED (sizeof (header)) - sizeof (header));
+  size_t nb = 0;
+  for (struct map_elem *e = m->first; *ok && e; e = _map_next (e), nb++) {
+    const void *bytes = 0;
+    struct map_dump_record record = { .size = serializer (e->data, &bytes), .flags = e->upper && e->upper->eq_next == e ? MAP_DUMP_EQUAL_KEY : 0 };
+    *ok = _map_write (w, &record, sizeof (record)) && _map_write (w, padding, MAP_DUMP_PADDED (sizeof (record)) - sizeof (record)) &&
+          (!record.size || _map_write (w, bytes, record.size)) && _map_write (w, padding, MAP_DUMP_PADDED (record.size) - record.size);
+  }
+  _map_unlock (m);
+  *ok = *ok && _map_write (w, 0, 0);
+  free (w);
+  if (!*ok) {
+    fprintf (stderr, "%s: %s\n", __func__, "Write error.");
+    return 0;
+  }
+  return nb;
+}
+
+size_t
+map_dump (map *m, int fd, map_serializer serializer) {
+  int ok;
+  return _map_dump (m, fd, serializer, 0, &ok);
+}
+
+// Format of a journal (in the native byte order and alignment of the machine):
+// - a header, as for a dump, with MAP_JOURNAL_MAGIC and a null number of elements ;
+// - a record per modification, in chronological order, as for a dump, the flags telling an insertion from a removal (MAP_JOURNAL_REMOVAL) or a removal of all the elements (MAP_JOURNAL_CLEAR).
+// The records following a record MAP_JOURNAL_GENERATION belong to the generation it holds, the previous ones to the generation of the header or of the previous such record.
+static const char MAP_JOURNAL_MAGIC[8] = "MAPJRNL";
+static const uint64_t MAP_JOURNAL_REMOVAL = 2;    // Flag: the element was removed (inserted otherwise).
+static const uint64_t MAP_JOURNAL_CLEAR = 4;      // Flag: all the elements were removed (the record has no data).
+static const uint64_t MAP_JOURNAL_GENERATION = 8; // Flag: a new generation starts (the record holds it, as a 64-bit integer), see map_checkpoint.
+
+// Group commit: records are appended to a buffer in memory, under the mutex of the map.
+// When a thread needs its records to be durable, it waits for a leader (another thread, or itself if none) to write and synchronise (fdatasync) the buffer to the file.
+// Meanwhile, other threads append their records to a new buffer, written and synchronised all together by the next leader:
+// concurrent writers share the cost of a synchronisation, instead of synchronising one after another.
+struct map_journal {
+  mtx_t mutex;
+  cnd_t synced; // Broadcast each time a group of records has been written and synchronised.
+  int fd;
+  map_serializer serializer;
+  char *buffer; // Records appended but not written yet
+  size_t used, capacity;
+  char *spare; // Records being written by the leader
+  size_t spare_capacity;
+  uint64_t nb_appended, nb_synced;
+  uint64_t generation;
+  int syncing; // A leader is writing and synchronising.
+  int failed;  // Records could not be appended or written: the journal is not reliable anymore.
+};
+
+static void
+_map_journal_append (struct map_journal *j, uint64_t flags, const void *bytes, size_t size) {
+  struct map_dump_record record = { .size = size, .flags = flags };
+  size_t length = MAP_DUMP_PADDED (sizeof (record)) + MAP_DUMP_PADDED (size);
+  mtx_lock (&j->mutex);
+  if (j->used + length > j->capacity) {
+    size_t capacity = j->capacity ? j->capacity : 4096;
+    while (capacity < j->used + length)
+      capacity *= 2;
+    char *buffer = realloc (j->buffer, capacity);
+    if (!buffer) {
+      j->failed = 1;
+      mtx_unlock (&j->mutex);
+      errno = ENOMEM;
+      fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+      return;
+    }
+    j->buffer = buffer;
+    j->capacity = capacity;
+  }
+  char *record_bytes = j->buffer + j->used;
+  memset (record_bytes, 0, length);
+  memcpy (record_bytes, &record, sizeof (record));
+  if (size)
+    memcpy (record_bytes + MAP_DUMP_PADDED (sizeof (record)), bytes, size);
+  j->used += length;
+  j->nb_appended++;
+  mtx_unlock (&j->mutex);
+}
+
+static void
+_map_journal_data (struct map *l, int removal, const void *data) {
+  const void *bytes = 0;
+  size_t size = l->journal->serializer (data, &bytes);
+  _map_journal_append (l->journal, removal ? MAP_JOURNAL_REMOVAL : 0, bytes, size);
+}
+
+static void
+_map_journal_keep (struct map *l, struct map_kept *kept, const void *data) {
+  kept->valid = 0;
+  if (!l->journal)
+    return;
+  const void *bytes = 0;
+  size_t size = l->journal->serializer (data, &bytes);
+  if (size > kept->capacity) {
+    void *buffer = realloc (kept->bytes, size);
+    if (!buffer) {
+      l->journal->failed = 1;
+      errno = ENOMEM;
+      fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+      return;
+    }
+    kept->bytes = buffer;
+    kept->capacity = size;
+  }
+  if (size)
+    memcpy (kept->bytes, bytes, size);
+  kept->size = size;
+  kept->valid = 1;
+}
+
+static void
+_map_journal_kept (struct map *l, const struct map_kept *kept) {
+  if (l->journal && kept->valid)
+    _map_journal_append (l->journal, MAP_JOURNAL_REMOVAL, kept->bytes, kept->size);
+}
+
+static void
+_map_journal_clear (struct map *l) {
+  _map_journal_append (l->journal, MAP_JOURNAL_CLEAR, 0, 0);
+}
+
+static int
+_map_journal_sync (struct map_journal *j) {
+  mtx_lock (&j->mutex);
+  uint64_t target = j->nb_appended; // All the records appended so far, including those of the calling thread.
+  while (j->nb_synced < target && !j->failed) {
+    if (j->syncing) { // Another thread leads: wait for it (its group might not include the records of the calling thread though.)
+      cnd_wait (&j->synced, &j->mutex);
+      continue;
+    }
+    j->syncing = 1; // Lead: take all the records appended so far.
+    char *buffer = j->buffer;
+    size_t used = j->used, capacity = j->capacity;
+    uint64_t nb_appended = j->nb_appended;
+    j->buffer = j->spare;
+    j->capacity = j->spare_capacity;
+    j->used = 0;
+    mtx_unlock (&j->mutex); // Other threads can append records meanwhile.
+    int ok = 1;
+    for (size_t done = 0; ok && done < used;) {
+      ssize_t ret = write (j->fd, buffer + done, used - done);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      ok = ret > 0;
+      done += ok ? (size_t)ret : 0;
+    }
+    ok = ok && !fdatasync (j->fd);
+    mtx_lock (&j->mutex);
+    j->spare = buffer;
+    j->spare_capacity = capacity;
+    if (ok)
+      j->nb_synced = nb_appended;
+    else
+      j->failed = 1;
+    j->syncing = 0;
+    cnd_broadcast (&j->synced);
+  }
+  int ok = !j->failed;
+  mtx_unlock (&j->mutex);
+  if (!ok) {
+    errno = EIO;
+    fprintf (stderr, "%s: %s\n", "map_journal", "Journal not written.");
+  }
+  return ok;
+}
+
+// _map_journal_reset empties the journal and restarts it with a header of generation 'generation'.
+static int
+_map_journal_reset (struct map_journal *j, uint64_t generation) {
+  struct map_dump_header header = { .version = MAP_DUMP_VERSION, .generation = generation };
+  char padded[MAP_DUMP_PADDED (sizeof (header))] = { 0 };
+  memcpy (header.magic, MAP_JOURNAL_MAGIC, sizeof (header.magic));
+  memcpy (padded, &header, sizeof (header));
+  int ok = !ftruncate (j->fd, 0) && lseek (j->fd, 0, SEEK_SET) == 0 && write (j->fd, padded, sizeof (padded)) == (ssize_t)sizeof (padded) && !fdatasync (j->fd);
+  if (ok)
+    j->generation = generation;
+  return ok;
+}
+
+// _map_journal_complete tells if the record of 'size' bytes of data, starting 'remaining' bytes before the end of the journal, was completely written.
+static int
+_map_journal_complete (uint64_t size, size_t remaining) {
+  return remaining >= MAP_DUMP_PADDED (sizeof (struct map_dump_record)) && size <= remaining - MAP_DUMP_PADDED (sizeof (struct map_dump_record)) &&
+         MAP_DUMP_PADDED ((size_t)size) <= remaining - MAP_DUMP_PADDED (sizeof (struct map_dump_record));
+}
+
+// _map_journal_scan reads the generation of the last records of the journal file 'fd' into '*generation'.
+// Returns the offset of the end of the last complete record (a torn record, interrupted while being written, follows it), or 0 if 'fd' is not a journal.
+static off_t
+_map_journal_scan (int fd, uint64_t *generation) {
+  struct map_dump_header header;
+  struct stat st;
+  if (fstat (fd, &st) < 0 || pread (fd, &header, sizeof (header), 0) != (ssize_t)sizeof (header) ||
+      memcmp (header.magic, MAP_JOURNAL_MAGIC, sizeof (header.magic)) || header.version != MAP_DUMP_VERSION)
+    return 0;
+  *generation = header.generation;
+  struct map_dump_record record;
+  off_t offset = (off_t)MAP_DUMP_PADDED (sizeof (header));
+  for (; pread (fd, &record, sizeof (record), offset) == (ssize_t)sizeof (record) && _map_journal_complete (record.size, (size_t)(st.st_size - offset));
+       offset += (off_t)(MAP_DUMP_PADDED (sizeof (record)) + MAP_DUMP_PADDED ((size_t)record.size))) {
+    uint64_t next;
+    if ((record.flags & MAP_JOURNAL_GENERATION) && record.size == sizeof (next) &&
+        pread (fd, &next, sizeof (next), offset + (off_t)MAP_DUMP_PADDED (sizeof (record))) == (ssize_t)sizeof (next))
+      *generation = next;
+  }
+  return offset;
+}
+
+static void
+_map_journal_free (struct map_journal *j) {
+  if (!j)
+    return;
+  _map_journal_sync (j);
+  cnd_destroy (&j->synced);
+  mtx_destroy (&j->mutex);
+  free (j->buffer);
+  free (j->spare);
+  free (j);
+}
+
+int
+map_set_journal (map *m, int fd, map_serializer serializer) {
+  if (!m || fd < 0 || !serializer) {
+    errno = EINVAL;
+    return 0;
+  }
+  struct map_journal *j = calloc (1, sizeof (*j));
+  if (!j || mtx_init (&j->mutex, mtx_plain) != thrd_success) {
+    free (j);
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  if (cnd_init (&j->synced) != thrd_success) {
+    mtx_destroy (&j->mutex);
+    free (j);
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  j->fd = fd;
+  j->serializer = serializer;
+  _map_lock (m);
+  uint64_t generation;
+  off_t end;
+  int ok = !m->journal && !m->pool; // The journal (its buffers and mutex) would not be shared by the processes sharing the map.
+  if (!ok)
+    errno = EPERM;
+  else if ((end = _map_journal_scan (fd, &generation)) && generation >= m->generation) {
+    // The journal goes on, after its last complete record: a torn record is cut off, durably, before anything is appended.
+    ok = !ftruncate (fd, end) && !fsync (fd) && lseek (fd, end, SEEK_SET) == end;
+    j->generation = generation;
+  } else
+    ok = _map_journal_reset (j, m->generation); // A new journal, or a journal older than the map (already included in the checkpoint the map was loaded from.)
+  if (ok)
+    m->journal = j;
+  _map_unlock (m);
+  if (!ok) {
+    fprintf (stderr, "%s: %s\n", __func__, errno == EPERM ? (m->pool ? "Map shared between processes." : "Journal already set.") : "Journal not written.");
+    _map_journal_free (j);
+  }
+  return ok;
+}
+
+struct map_replayed {
+  struct map *map;
+  map_serializer serializer;
+  const void *bytes;
+  size_t size;
+  void (*dtor) (void *);
+};
+
+static int
+_map_replay_select (const void *data, void *sel_arg, const void *context) {
+  (void)context;
+  const struct map_replayed *r = sel_arg;
+  const void *bytes = 0;
+  return r->serializer (data, &bytes) == r->size && (!r->size || !memcmp (bytes, r->bytes, r->size));
+}
+
+static int
+_map_replay_remove (void *data, void *op_arg, int *remove, const void *context) {
+  (void)context;
+  const struct map_replayed *r = op_arg;
+  if (r->dtor && !_map_is_mapped (r->map->mappings, data)) // Data used in place in a file mapped by map_load_mmap are not free'd.
+    r->dtor (data);
+  *remove = 1;
+  return 0; // Only one element is removed.
+}
+
+size_t
+map_replay_journal (map *m, const char *path, map_serializer serializer, map_deserializer deserializer, void (*dtor) (void *)) {
+  if (!m || !path || !serializer || !deserializer) {
+    errno = EINVAL;
+    return 0;
+  }
+  int fd = open (path, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && !fstat (fd, &st) && !st.st_size) { // An empty journal (interrupted while being reset).
+    close (fd);
+    return 0;
+  }
+  if (fd < 0 || fstat (fd, &st) < 0 || (size_t)st.st_size < MAP_DUMP_PADDED (sizeof (struct map_dump_header))) {
+    if (fd >= 0)
+      close (fd);
+    errno = fd < 0 ? errno : EINVAL;
+    fprintf (stderr, "%s: %s\n", __func__, "Invalid file.");
+    return 0;
+  }
+  size_t length = (size_t)st.st_size;
+  char *addr = mmap (0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (addr == MAP_FAILED) {
+    fprintf (stderr, "%s: %s\n", __func__, "Could not map the file in memory.");
+    return 0;
+  }
+  const struct map_dump_header *header = (const void *)addr;
+  if (memcmp (header->magic, MAP_JOURNAL_MAGIC, sizeof (header->magic)) || header->version != MAP_DUMP_VERSION) {
+    munmap (addr, length);
+    errno = EINVAL;
+    fprintf (stderr, "%s: %s\n", __func__, "Invalid file.");
+    return 0;
+  }
+  _map_lock (m);
+  uint64_t oldest = m->generation; // Modifications of previous generations are already in the checkpoint the map was loaded from.
+  _map_unlock (m);
+  uint64_t generation = header->generation;
+  size_t nb = 0;
+  int ok = 1;
+  // A truncated last record (interrupted while being written) is ignored: it had not been synchronised, and its modification not acknowledged.
+  for (size_t offset = MAP_DUMP_PADDED (sizeof (*header)); ok && length - offset >= MAP_DUMP_PADDED (sizeof (struct map_dump_record));) {
+    const struct map_dump_record *record = (const void *)(addr + offset);
+    if (!_map_journal_complete (record->size, length - offset))
+      break;
+    const void *bytes = addr + offset + MAP_DUMP_PADDED (sizeof (*record));
+    offset += MAP_DUMP_PADDED (sizeof (*record)) + MAP_DUMP_PADDED ((size_t)record->size);
+    if ((record->flags & MAP_JOURNAL_GENERATION) && record->size == sizeof (generation))
+      memcpy (&generation, bytes, sizeof (generation));
+    if ((record->flags & MAP_JOURNAL_GENERATION) || generation < oldest)
+      continue;
+    nb++;
+    if (record->flags & MAP_JOURNAL_CLEAR) {
+      map_clear (m, dtor);
+      continue;
+    }
+    void *data = deserializer (bytes, (size_t)record->size);
+    if (!(ok = data != 0))
+      break;
+    if (record->flags & MAP_JOURNAL_REMOVAL) {
+      struct map_replayed r = { .map = m, .serializer = serializer, .bytes = bytes, .size = (size_t)record->size, .dtor = dtor };
+      if (m->cmp_key)
+        map_find_key (m, m->get_key (data), _map_replay_remove, &r, _map_replay_select, &r);
+      else
+        map_traverse (m, _map_replay_remove, &r, _map_replay_select, &r);
+      if (dtor)
+        dtor (data); // data was only needed to get the key.
+    } else if (!map_insert_data (m, data) && dtor)
+      dtor (data);
+  }
+  munmap (addr, length);
+  if (!ok) {
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  return nb;
+}
+
+int
+map_checkpoint (map *m, const char *path, map_serializer serializer) {
+  if (!m || !path || !serializer) {
+    errno = EINVAL;
+    return 0;
+  }
+  // The map is dumped into a temporary file, which is synchronised and then renamed (atomically) to 'path', and the directory synchronised.
+  // Therefore, 'path' always holds a complete dump, the former or the new one, whenever the process or the system stops.
+  size_t length = strlen (path);
+  char *tmp = malloc (length + sizeof (".tmp"));
+  char *dir = malloc (length + sizeof ("."));
+  if (!tmp || !dir) {
+    free (tmp);
+    free (dir);
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+    return 0;
+  }
+  strcpy (tmp, path);
+  strcat (tmp, ".tmp");
+  const char *slash = strrchr (path, '/');
+  if (slash) {
+    memcpy (dir, path, (size_t)(slash - path) + 1);
+    dir[slash - path + 1] = 0;
+  } else
+    strcpy (dir, ".");
+  // The map is locked while it is serialized and written (into the page cache of the system): the serializer is never called on data removed meanwhile by other threads.
+  // The dump is then synchronised to storage, the longest part, while other threads go on modifying the map.
+  // If the map is journaled, the modifications journaled after the dump start a new generation, the one of the checkpoint:
+  // should the system stop, map_replay_journal replays them on top of the new checkpoint, or all the journal on top of the former one.
+  int ok = 0;
+  int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  _map_lock (m);
+  struct map_journal *j = m->journal;
+  uint64_t generation = j ? j->generation + 1 : m->generation, mark = 0;
+  if (fd >= 0)
+    _map_dump (m, fd, serializer, &generation, &ok);
+  if (ok && j) {
+    _map_journal_append (j, MAP_JOURNAL_GENERATION, &generation, sizeof (generation));
+    mtx_lock (&j->mutex);
+    j->generation = generation;
+    mark = j->nb_appended;
+    mtx_unlock (&j->mutex);
+  }
+  _map_unlock (m);
+  if (fd >= 0) {
+    ok = !fsync (fd) && ok;
+    ok = !close (fd) && ok;
+    ok = ok && !rename (tmp, path);
+    if (!ok)
+      unlink (tmp);
+  }
+  if (ok) {
+    fd = open (dir, O_RDONLY);
+    ok = fd >= 0 && !fsync (fd);
+    if (fd >= 0)
+      close (fd);
+  }
+  _map_lock (m);
+  if (ok && j) { // The modifications journaled before the dump are in the checkpoint: the journal restarts empty, unless others were journaled since.
+    mtx_lock (&j->mutex);
+    if (j->nb_appended == mark && !j->syncing) { // The records not written yet are in the checkpoint too.
+      j->used = 0;
+      j->nb_synced = mark;
+      j->failed = !_map_journal_reset (j, generation); // Whatever happened to the journal before, the checkpoint holds all the modifications.
+      cnd_broadcast (&j->synced);
+    }
+    mtx_unlock (&j->mutex);
+  }
+  if (ok)
+    m->generation = generation;
+  _map_unlock (m);
+  if (!ok)
+    fprintf (stderr, "%s: %s\n", __func__, "Checkpoint not saved.");
+  free (tmp);
+  free (dir);
+  return ok;
+}
+
+size_t
+map_load_mmap (map *m, const char *path, map_deserializer deserializer) {
+  if (!m || !path) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (m->pool) { // The elements would be allocated from the pool, but the mapped file would not be shared by the processes sharing the map.
+    errno = EPERM;
+    fprintf (stderr, "%s: %s\n", __func__, "Map shared between processes.");
+    return 0;
+  }
+  int fd = open (path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) < 0 || (size_t)st.st_size < sizeof (struct map_dump_header)) {
+    if (fd >= 0)
+      close (fd);
+    errno = fd < 0 ? errno : EINVAL;
+    fprintf (stderr, "%s: %s\n", __func__, "Invalid file.");
+    return 0;
+  }
+  size_t length = (size_t)st.st_size;
+  // A private mapping: the data used in place can be modified without modifying the file. Unmodified pages are shared with the other processes mapping the file.
+  char *addr = mmap (0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (addr == MAP_FAILED) {
+    fprintf (stderr, "%s: %s\n", __func__, "Could not map the file in memory.");
+    return 0;
+  }
+  // First pass: the content of the file is checked, and the number of distinct keys counted.
+  const struct map_dump_header *header = (const void *)addr;
+  size_t nb_elem = 0, nb_heads = 0;
+  size_t offset = MAP_DUMP_PADDED (sizeof (*header));
+  int ok = !memcmp (header->magic, MAP_DUMP_MAGIC, sizeof (header->magic)) && header->version == MAP_DUMP_VERSION;
+  for (; ok && offset < length; nb_elem++) {
+    const struct map_dump_record *record = (const void *)(addr + offset);
+    if (length - offset < MAP_DUMP_PADDED (sizeof (*record)) || record->size > length - offset - MAP_DUMP_PADDED (sizeof (*record)) ||
+        ((record->flags & MAP_DUMP_EQUAL_KEY) && (!nb_elem || m->uniqueness || !m->cmp_key)))
+      ok = 0;
+    else {
+      nb_heads += !(record->flags & MAP_DUMP_EQUAL_KEY);
+      offset += MAP_DUMP_PADDED (sizeof (*record)) + MAP_DUMP_PADDED ((size_t)record->size);
+    }
+  }
+  ok = ok && nb_elem == header->nb_elem && offset == length;
+  struct map_mapping *mapping = ok && !deserializer ? malloc (sizeof (*mapping)) : 0;
+  atomic_size_t *nb_refs = mapping ? malloc (sizeof (*nb_refs)) : 0;
+  struct map_elem **heads = ok && (deserializer || nb_refs) ? malloc ((nb_heads ? nb_heads : 1) * sizeof (*heads)) : 0;
+  _map_lock (m);
+  if (!heads || m->first) {
+    _map_unlock (m);
+    free (heads);
+    free (nb_refs);
+    free (mapping);
+    munmap (addr, length);
+    errno = !ok ? EINVAL : heads ? EPERM : ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, !ok ? "Invalid file." : heads ? "Not empty. Not loaded." : "Out of memory.");
+    return 0;
+  }
+  // Second pass: the elements are created in order, distinct keys as heads, equal keys in lists hanging from their heads.
+  size_t nb = 0, nb_loaded = 0;
+  struct map_elem *tail = 0;
+  offset = MAP_DUMP_PADDED (sizeof (*header));
+  for (size_t i = 0; i < nb_elem; i++) {
+    const struct map_dump_record *record = (const void *)(addr + offset);
+    void *bytes = addr + offset + MAP_DUMP_PADDED (sizeof (*record));
+    offset += MAP_DUMP_PADDED (sizeof (*record)) + MAP_DUMP_PADDED ((size_t)record->size);
+    struct map_elem *new = calloc (1, sizeof (*new));
+    void *data = !new ? 0 : deserializer ? deserializer (bytes, (size_t)record->size) : bytes;
+    if (!data) {
+      free (new);
+      break;
+    }
+    *new = (struct map_elem){ .data = data, .map = m, .nb_equal = 1 };
+    new->key_from_data = m->get_key ? m->get_key (data) : 0;
+    if (record->flags & MAP_DUMP_EQUAL_KEY) {
+      (tail->eq_next = new)->upper = tail;
+      (new->eq_head = heads[nb - 1])->eq_tail = new;
+      heads[nb - 1]->nb_equal++;
+    } else
+      heads[nb++] = new;
+    tail = new;
+    nb_loaded++;
+  }
+  if (nb_loaded < nb_elem) { // Out of memory
+    for (size_t i = 0; i < nb; i++)
+      for (struct map_elem *e = heads[i], *next; e; e = next) {
+        next = e->eq_next;
+        free (e);
+      }
+    nb_loaded = 0;
+    errno = ENOMEM;
+    fprintf (stderr, "%s: %s\n", __func__, "Out of memory.");
+  } else {
+    _map_build (m, heads, nb);
+    m->nb_elem = nb_loaded;
+    m->stats.nb_allocations += nb_loaded;
+    m->generation = header->generation;
+  }
+  if (nb_loaded && mapping) { // The mapping is kept as long as the map exists, since data are used in place.
+    atomic_init (nb_refs, 1);
+    *mapping = (struct map_mapping){ .addr = addr, .length = length, .nb_refs = nb_refs, .next = m->mappings };
+    m->mappings = mapping;
+  } else {
+    free (nb_refs);
+    free (mapping);
+    munmap (addr, length);
+  }
+  _map_unlock (m);
+  free (heads);
+  return nb_loaded;
+}
+
 static int
 _MAP_REMOVE (void *data, void *context, int *remove, const void *map_context) {
   (void)map_context;
@@ -778,6 +2564,8 @@ _MAP_MOVE (void *data, void *context, int *remove, const void *map_context) {
     errno = EINVAL;
     return 0;
   }
+  // map_find_key, map_traverse and map_traverse_backward transplant elements (see _map_move) and do not call MAP_MOVE_TO.
+  // It is only called if used from inside a user-defined operator, and then moves data with a reallocation.
   // Elements that do not respect the unicity constraint of the destination map will not be moved and will remain in the source map.
   *remove = map_insert_data (context, data);
   return 1;
@@ -813,6 +2601,7 @@ _MAP_EXISTS_ONE (void *data, void *context, int *remove, const void *map_context
 
 const map_operator MAP_EXISTS_ONE = _MAP_EXISTS_ONE;
 const map_operator MAP_COUNT = 0;
+const int MAP_REKEY = INT_MIN;
 
 static int
 map_generic_cmp (const void *key_a, const void *key_b, const void *arg) {
@@ -23,6 +23,7 @@ The interface has no more than 9 functions to do everything needed (create, read
 - Map management:
 
  - `map_create`
+ - `map_create_shared` (maps shared between processes)
  - `map_destroy` (MT-safe)
 
 - Map usage:
@@ -35,8 +36,18 @@ The interface has no more than 9 functions to do everything needed (create, read
 - Other features:
 
  - `map_set_context` (MT-safe, optional)
- - `map_traverse_keys` (MT-safe)
+ - `map_set_splaying` (MT-safe, optional)
+ - `map_set_secondary_comparator` and `map_find_data` (MT-safe, optional)
+ - `map_traverse_keys` and `map_count_key` (MT-safe)
+ - `map_merge_keys` (MT-safe)
  - `map_size` (MT-safe)
+ - `map_clear` and `map_destroy_all` (MT-safe)
+ - `map_clear_async` and `map_destroy_async` (MT-safe)
+ - `map_snapshot` (MT-safe)
+ - `map_dump`, `map_checkpoint` and `map_load_mmap` (MT-safe)
+ - `map_set_journal` and `map_replay_journal` (MT-safe)
+ - `map_transaction` (MT-safe)
+ - `map_stats` and `map_lock_profile` (MT-safe)
 
 They are detailed below.
 
@@ -140,7 +151,35 @@ typedef int (*map_operator) (void *data, void *op_arg, int *remove, const void *
 //   - the operator **should** ultimately free the data passed to it **if** it was allocated dynamically before insertion into the map with `map_insert_data` (otherwise data would be lost in memory leaks).
 // The `map_operator` should return `1` if the operator should be applied on further elements of the map (continue), `0` otherwise (break). In other words,
 // as soon as the operator returns `0`, it stops `map_traverse`, `map_traverse_backward` or `map_find_key`.
-// > The operator `map_operator` should neither modify the pointer returned by `map_key_extractor` nor its content (as evaluated by `map_key_comparator`). In other words, the key of the element in the map should remain untouched by `map_operator`, otherwise results are undefined.
+// > The operator `map_operator` should neither modify the pointer returned by `map_key_extractor` nor its content (as evaluated by `map_key_comparator`). In other words, the key of the element in the map should remain untouched by `map_operator`, otherwise results are undefined,
+// unless the operator sets `*remove` to `MAP_REKEY` (see below).
+
+// ### Change the key of an element in place
+extern const int MAP_REKEY;
+// If the operator modifies the key of an element (or its data as evaluated by the secondary comparator, see `map_set_secondary_comparator`), it **must** set `*remove` to `MAP_REKEY`.
+// The element is then unlinked from the map, and linked back at its new position at the end of the outermost `map_find_key`, `map_traverse` or `map_traverse_backward`,
+// without any reallocation (the key is evaluated again by `get_key`.) Therefore, an element with a changed key is neither traversed nor found twice (even by an enclosing traversal
+// if the key is changed by a nested call), and it is not found by nested calls in the operator meanwhile.
+// > If the new key does not respect the unicity constraint of the map (it is the key of another element, or the new key of another element changed in the same traversal),
+// the change is refused, and `errno` is set to `EPERM`: the operator is then called a second time on the element, with `*remove` set to `MAP_REKEY` on entry.
+// It **must** then either restore the former key of the element (which stays in place), or set `*remove` to `1` to remove the element. Its return value is ignored.
+// Complexity : log n per changed element (plus the number of elements changed in the traversal, for a map with unicity constraint). MT-safe. Non-recursive.
+/* Example: to update the priority of a task (decrease-key), without removing and inserting it again:
+
+  static int
+  set_priority (void *data, void *op_arg, int *remove, const void *context) {
+    ((struct task *)data)->priority = *(int *)op_arg; // The key of the task is changed in place.
+    *remove = MAP_REKEY;                              // The task is moved to its new position.
+    return 0;
+  }
+
+  static int
+  is (const void *data, void *sel_arg, const void *context) {
+    return data == sel_arg;
+  }
+
+  map_find_key (tasks, &task->priority, set_priority, &(int){ 1 }, is, task); // Where get_key returns &task->priority.
+*/
 
 // ## Interface
 
@@ -171,24 +210,111 @@ __attribute__ ((warn_unused_result)) map *map_create (map_key_extractor get_key,
 For unsorted lists, sets or maps on type `T` of fixed size, a generic comparison function `MAP_GENERIC_CMP` is provided.
 */
 
+// ### Share a map between processes
+__attribute__ ((warn_unused_result)) map *map_create_shared (map_key_extractor get_key, map_key_comparator cmp_key, const void *cmp_arg, int unicity, size_t capacity);
+// Same as `map_create`, except that the map, and a pool of `capacity` elements, are placed in a segment of POSIX shared memory (see `shm_open`).
+// The map is shared with the processes forked afterwards by the calling process (and by them): they can all insert into, find in and remove from the same map, concurrently.
+// Returns `0` if the segment could not be allocated (and `errno` set to `ENOMEM`), or if `capacity` is `0` (and `errno` set to `EINVAL`).
+// The mutex of the map is a process-shared, robust and recursive POSIX mutex. If a process dies while holding it (in the middle of a traversal for instance),
+// the next process to lock the map goes on with it: the traversals of the dead process are ended, the tree of the map is rebuilt, and a warning is reported on `stderr`.
+// The element the dead process was modifying, if any, might be inconsistent though.
+// `map_insert_data` returns `0` (and `errno` set to `ENOMEM`) once the pool is exhausted. Removed elements are given back to the pool.
+// > The segment is shared, but the address space is not: the data inserted into the map must themselves be in memory shared by the processes (such as a segment mapped with `MAP_SHARED`),
+// > and the key extractor, the comparators, the selectors, the operators and the context are those of the calling process, inherited by the forked processes.
+// > Elements moved by `MAP_MOVE_TO` between a map shared between processes and another map are reallocated (an element stays in its map, with `errno` set to `ENOMEM`, if the destination pool is exhausted.)
+// > `map_clear_async` and `map_destroy_async` deallocate the elements of a shared map in the calling thread (as `map_clear` and `map_destroy_all`).
+// > `map_set_journal` and `map_load_mmap` do not apply to shared maps (`0` is returned and `errno` set to `EPERM`). `map_snapshot` returns a map private to the calling process.
+// > `map_destroy` unmaps the map from the calling process only: the other processes can go on using it. The segment is released when the last process unmaps it or ends.
+/* Example:
+
+  struct event *events = mmap (0, n * sizeof (*events), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  map *index = map_create_shared (get_date, cmp_date, 0, 0, n);
+  for (int p = 0; p < 4; p++)
+    if (!fork ()) { ... map_insert_data (index, &events[i]); ... _exit (0); } // Workers, indexing events concurrently.
+  ...                                                                         // The parent finds events in the same index, while they are indexed.
+*/
+
 // ### Define an optional global context to a map
 void *map_set_context (map *, void *context);
 // The `context` will be passed as the last argument to operators and selectors.
 // Returns the context set by a previous call to `map_set_context`.
 // > By default, the contexte of a map is the map itself.
 
+// ### Make a map self-adjusting to skewed accesses (optional)
+int map_set_splaying (map *, int splaying);
+// If `splaying` is not `0`, each element found by `map_find_key` is moved up towards the root of the binary tree (as in a semi-splay tree).
+// Frequently found elements then gather near the root and are found faster, at the cost of rotations on each search.
+// This can be worth it when few keys get most of the calls to `map_find_key` (skewed access patterns) and comparing keys is costly. Otherwise, the default balancing performs better
+// (for a Zipf distribution of accesses on 100,000 integer keys, the default balancing is about twice as fast.)
+// If splaying is switched off, a splayed tree is rebuilt (in n) to respect the balancing criterion again.
+// Returns the property set by a previous call to `map_set_splaying`, `0` by default.
+// > The order of elements, as traversed by `map_traverse` and `map_traverse_backward`, is not affected.
+
+// ### Order the elements of equal keys (optional)
+int map_set_secondary_comparator (map *, map_key_comparator cmp_data, const void *arg);
+// By default, the elements of equal keys of a map without unicity constraint are kept in a list, in the order of insertion,
+// and finding one of them in particular (with a selector) is linear in the number of elements of the key.
+// If `cmp_data` is set, the elements of equal keys are ordered by `cmp_data (data_a, data_b, arg)`, applied on their data (rather than their keys), and stored as distinct nodes of the balanced tree.
+// One of them can then be found (or removed) by its data with `map_find_data`, in log n, however many elements have the same key.
+// Elements both of equal keys and equal for `cmp_data` are still kept in a list, in the order of insertion.
+// `map_find_key`, `map_traverse`, `map_count_key` and `map_traverse_keys` are unchanged: elements of equal keys are found in the order of `cmp_data`.
+// Returns `0` (and `errno` set to `EPERM`) if the map is not empty, has no key comparator, or has a unicity constraint, `1` otherwise.
+// > A dump of a map with a secondary comparator should be reloaded into a map with the same secondary comparator.
+
+/* Example:
+  static int cmp_id (const void *a, const void *b, const void *arg) { ... } // Compares the identifiers of two events.
+  map *events = map_create (get_date, cmp_date, 0, 0); // Events by date, with many events a day.
+  map_set_secondary_comparator (events, cmp_id, 0);
+  ...
+  map_find_data (events, &(struct event){ .date = today, .id = 42 }, MAP_REMOVE_ONE, &event); // In log n.
+*/
+
 // ### Destroy a map
 int map_destroy (map *);
 // Destroys an **empty** and previously created map.
 // If the map is not empty, the map is not destroyed.
 // Returns `0` (and `errno` set to `EPERM`) if the map is not empty (and the map is NOT destroyed), `1` otherwise.
 
+// ### Remove all the elements of a map
+size_t map_clear (map *, void (*dtor) (void *));
+// Removes all the elements of the map, and applies the destructor `dtor` (such as `free`), if not `0`, on their data.
+// Returns the number of elements removed.
+// The elements are detached from the map at once: the map is empty and can be used by other threads right away.
+// The elements are then deallocated in a single pass, without rebalancing (unlike `map_traverse (map, MAP_REMOVE_ALL, dtor, 0, 0)`).
+// Complexity : n. MT-safe. Non-recursive.
+// > `map_clear` can not be called from inside an operator of `map_find_key`, `map_traverse` or `map_traverse_backward` on the same map (`0` is returned and `errno` set to `EPERM`).
+// > If the map is journaled (see `map_set_journal`), the removal of all the elements is journaled as a single record.
+
+// ### Remove all the elements of a map and destroy it
+int map_destroy_all (map *, void (*dtor) (void *));
+// Equivalent to `map_clear (map, dtor)` followed by `map_destroy (map)`.
+// Returns `0` (and `errno` set to `EPERM`) if the map could not be destroyed (if elements were inserted by another thread meanwhile), `1` otherwise.
+// Complexity : n. MT-safe. Non-recursive.
+
+// ### Remove all the elements of a map, or destroy it, in the background
+size_t map_clear_async (map *, void (*dtor) (void *));
+int map_destroy_async (map *, void (*dtor) (void *));
+// Same as `map_clear` and `map_destroy_all`, except that the elements are deallocated (and `dtor` applied on their data) later, by a background thread, the reclaimer,
+// rather than by the calling thread: the map is emptied (or destroyed) at once, whatever its size.
+// The reclaimer deallocates elements by batches of `MAP_RECLAIM_BATCH` (4096 by default), separated by pauses of `MAP_RECLAIM_PAUSE_NS` nanoseconds (100 µs by default),
+// to bound its contention on the memory allocator with the other threads. Both can be defined at compilation of the library.
+// The reclaimer is started on first use. At exit, it deallocates the remaining elements without pause before the process ends.
+// If the reclaimer can not be started, the elements are deallocated by the calling thread, as by `map_clear`.
+// Unlike `map_destroy_all`, `map_destroy_async` empties and destroys the map in one go: it returns `1`, or `0` if the map is `0` (with `errno` set to `EINVAL`)
+// or being traversed by the calling thread (with `errno` set to `EPERM`).
+// Complexity : 1 for the calling thread. MT-safe. Non-recursive.
+// > `dtor` is called by the reclaimer, concurrently with the other threads: the data of the elements must not be shared with anything else than the map.
+/* Example: to release a large index without a latency spike on the calling thread.
+
+  map_destroy_async (index, free);
+*/
+
 // ### Add an element into a map
 __attribute__ ((warn_unused_result)) int map_insert_data (map *, void *data);
 // Adds a previously allocated data into map and returns `1` if the element was added, `0` otherwise.
 // > `data` should be a pointer to `T`, where `T` is the type managed by the map.
 // > The map keeps track of `data` but `data` does not belong to (is not copied and stored in) the map after insertion. `*data` should persist until it is removed from the map (using `map_traverse` or `map_find_key`).
-// > If `data` is a pointer to memory allocated dynamically, a destructor should be passed as an argument to operator `MAP_REMOVE_ALL` in case it would be used.
+// > If `data` is a pointer to memory allocated dynamically, a destructor should be passed as an argument to operator `MAP_REMOVE_ALL`, `map_clear` or `map_destroy_all` in case they would be used.
 // `0` will be returned if `unicity` was set to `1` at creation of the map and a data with the same key is already in the map (`data` is not inserted in the map).
 // > An insertion might fail due to unicity constraint and should be checked.
 // > If `map_insert_data` returns 0 and `data` was allocated dynamically, as `data` is not inserted in the map, it won't be tracked. If must then be free'd by the caller.
@@ -219,6 +345,21 @@ size_t map_find_key (struct map *map, const void *key, map_operator op, void *op
 // > `map_find_key`, `map_traverse`, `map_traverse_backward` and `map_insert_data` can call each other *in the same thread* (the first argument `map` can be passed again through the `op_arg` argument). Therefore,
 // elements can be removed from (when `*remove` is set to `1` in `op`) or inserted into (when `map_insert_data` is called in `op`) the map *by the same thread* while finding elements.
 
+// #### Count the elements of a key
+size_t map_count_key (map *map, const void *key);
+// Returns the number of elements of the map which key is equal to `key`, as `map_find_key (map, key, 0, 0, 0, 0)` would, but without visiting them:
+// each key keeps the number of its elements.
+// Complexity : log n (plus the number of distinct elements of the key for the secondary comparator, if set.) MT-safe. Non-recursive.
+// > `cmp_key` should have been previously set by `map_create` (otherwise, `0` is returned and `errno` is set to `EPERM`.)
+
+// #### Find an element from its data
+size_t map_find_data (map *map, const void *data, map_operator op, void *op_arg);
+// Applies `op` on the elements of the map which key is equal to the key of `data` and which data is equal to `data` for the secondary comparator set with `map_set_secondary_comparator`,
+// as long as `op` returns non-zero. `data` can be any pointer to a `T` that holds (at least) what the key extractor and the comparators read.
+// Without secondary comparator, `map_find_data (map, data, op, op_arg)` is `map_find_key (map, get_key (data), op, op_arg, 0, 0)`.
+// Returns the number of elements of the map on which the operator `op` (if set) has been applied.
+// Complexity : log n. MT-safe. Non-recursive.
+
 // #### Traverse the elements of a map
 size_t map_traverse (map *map, map_operator op, void *op_arg, map_selector sel, void *sel_arg);
 size_t map_traverse_backward (map *map, map_operator op, void *op_arg, map_selector sel, void *sel_arg);
@@ -233,6 +374,9 @@ size_t map_traverse_backward (map *map, map_operator op, void *op_arg, map_selec
 // If `op` and `sel `are null, `map_traverse` and `map_traverse_backward` simply count and return the number of elements in the map (as would `map_size`).
 // > `map_find_key`, `map_traverse`, `map_traverse_backward` and `map_insert_data` can call each other *in the same thread* (the first argument `map` can be passed again through the `op_arg` argument). Therefore,
 // elements can be removed from (when `*remove` is set to `1` in `op`) or inserted into (when `map_insert_data` is called in `op`) the map *by the same thread* while traversing elements.
+// > Elements removed while traversing (or finding) are unlinked at once. The first ones are rebalanced one by one (in log n each), as long as they cost less than a rebuild of the tree.
+// Beyond (about n / log2 n removals), their balancing is deferred, and the tree is rebuilt once, in n, at the end of the outermost `map_traverse`, `map_traverse_backward` or `map_find_key`.
+// Therefore, removing many (or all) elements while traversing costs about 2n rather than n.log n.
 // > Insertion while traversing should be done with care since an infinite loop **will** logically occur if, in `op`:
 // >
 // >  - while traversing forward: at least an equal or greater element is inserted (after the element being traversed) ;
@@ -245,6 +389,126 @@ size_t map_traverse_keys (map *map, map_operator_on_key op, void *op_arg);
 // > `key` is a pointer to a key, as returned by a function of type `map_key_extractor`.
 // For each distinct key of a map, the operator `op` (if not null) is called once with the *key* (as returned by the declared `get_key` passed to `map_create`) passed as its first element, the number of entries of the key as its second, `op_arg` as its third, and the context of the map (set by a previous call to `map_set_context`, or, by default, the map to which `data` belongs to) as ist fourth.
 // Returns `0` if `get_key` is `0` (with `errno` set to `EPERM`), the number of keys otherwise.
+// Complexity : number of distinct keys (the number of entries of each key is known without visiting them). MT-safe. Non-recursive.
+
+// ### Merge the elements of two keys
+size_t map_merge_keys (map *map, const void *old_key, const void *new_key, void (*relabel) (void *arg), void *arg);
+// Moves all the elements of key `old_key` after the elements of key `new_key`, without reallocation and without visiting them.
+// The elements of `old_key` are then found with `new_key`: their keys (as returned by `get_key`) **must** be made equal to `new_key` by `relabel`,
+// called once (with `arg` as argument) after the elements are moved and before the map is unlocked.
+// Until `relabel` returns, the map is inconsistent: `relabel` should only change the keys, and not use the map.
+// This is done at once if the keys of the elements are shared by reference (for instance, if `get_key` returns a pointer to a label shared by all the elements of a group: see `examples/test_group_union_find.c`.)
+// > If `relabel` is `0`, relabelling the moved elements is a precondition of any further use of the map: it must then be done by the caller right after,
+// inside `map_transaction` if the map is shared between threads. Otherwise, finds and insertions give wrong results.
+// Returns the number of elements moved, `0` if `old_key` or `new_key` have no element (and then `relabel` is not called).
+// Complexity : log n. MT-safe. Non-recursive.
+// > `map_merge_keys` requires a map without unicity constraint, without secondary comparator (see `map_set_secondary_comparator`) and not journaled (see `map_set_journal`),
+// and can not be called from inside an operator of `map_find_key`, `map_traverse` or `map_traverse_backward` on the same map, otherwise `0` is returned and `errno` is set to `EPERM`.
+
+// ### Take a snapshot of a map
+__attribute__ ((warn_unused_result)) map *map_snapshot (map *);
+// Returns a new map which is a consistent copy of the map, as it is at the time of the call, or `0` if the snapshot could not be allocated (and `errno` set to `ENOMEM`).
+// The snapshot has the same key extractor, comparator, unicity and context as the map. Its elements are ordered the same way.
+// The map is locked only while its elements are copied, and no user-defined function is called meanwhile. The snapshot can then be traversed or searched
+// (for reporting for instance) without locking the map: other threads can insert into or remove from the map meanwhile.
+// > The data are *not* duplicated, and are therefore *shared* (by reference) by both the map and its snapshot (as with `MAP_COPY_REF_TO`). They should be free'd only *once*.
+// > Data used in place in a file mapped by `map_load_mmap` are not free'd by `map_destroy_all` on either of them, and the file remains mapped till the map and all its snapshots are destroyed.
+// > The snapshot should be destroyed, when not needed anymore, with `map_destroy_all (snapshot, 0)`.
+// Complexity : n (without any comparison of keys). MT-safe. Non-recursive.
+
+// ### Save and reload a map
+// #### Dump a map
+// The type of a user-defined function that serializes the data of an element of a map.
+typedef size_t (*map_serializer) (const void *data, const void **bytes);
+// > `data` is a pointer to `T`, where `T` is the type managed by the map. Use `(T *)data` to access its content.
+// Should set `*bytes` to the address of the serialized form of `data` and return its size (in bytes). The serialized form should persist till the next call to the serializer.
+// For data of type `T` without any pointer, the serializer can simply set `*bytes` to `data` and return `sizeof (T)`.
+size_t map_dump (map *, int fd, map_serializer serializer);
+// Writes the elements of a map, serialized by `serializer`, in the order of the map, to the file descriptor `fd`, in a compact binary format.
+// Returns the number of elements written, or `0` on failure (with `errno` set).
+// > The binary format depends on the architecture of the machine (byte order and alignment).
+// Complexity : n. MT-safe.
+
+// #### Checkpoint a map
+int map_checkpoint (map *, const char *path, map_serializer serializer);
+// Dumps a map (as `map_dump`) into the file `path`, durably and atomically: the dump is written into the temporary file `path.tmp`,
+// synchronised to storage, and then renamed to `path`.
+// Whenever the process or the system stops, `path` holds either the former checkpoint or the new one, complete, ready to be reloaded by `map_load_mmap`.
+// Returns `1` on success, `0` otherwise (with `errno` set), in which case `path` is left unchanged.
+// > Together with `map_load_mmap` (with a null deserializer), this makes a map persistent across restarts:
+// > the map is reloaded from its last checkpoint in a single pass, without any comparison of keys nor copy of data.
+// The map is locked only while its elements are serialized and written (into the page cache of the system): the dump is then synchronised to storage while other threads go on using the map.
+// If a journal is set (see `map_set_journal`), it is emptied: the checkpoint holds all the modifications journaled before the dump.
+// If other modifications were journaled meanwhile, the journal is kept, and `map_replay_journal` skips the records older than the checkpoint. It is emptied by a later checkpoint.
+// Complexity : n. MT-safe. Bound by input/output.
+
+// #### Reload a map
+// The type of a user-defined function that rebuilds data from its serialized form.
+typedef void *(*map_deserializer) (const void *bytes, size_t size);
+// Should return a pointer to `T` (generally allocated dynamically), built from the `size` bytes at `bytes`, as serialized by a `map_serializer`, or `0` on failure.
+size_t map_load_mmap (map *, const char *path, map_deserializer deserializer);
+// Maps the file `path`, written by `map_dump`, in memory and loads its elements into an **empty** map, without any comparison of keys.
+// The map should have been created with the same key extractor, comparator and unicity as the dumped map.
+// If `deserializer` is not `0`, the data of the elements are rebuilt by `deserializer` and the file is unmapped.
+// If `deserializer` is `0`, the data of the elements are the serialized forms themselves, as mapped in memory, with no copy (aligned for any type).
+// The file then remains mapped till the map is destroyed by `map_destroy`.
+// Returns the number of loaded elements, or `0` on failure (with `errno` set to `EPERM` if the map is not empty, `EINVAL` if the file is not a valid dump, `ENOMEM` if out of memory.)
+// > If `deserializer` is `0`, data should not be free'd (elements should be removed with `MAP_REMOVE_ALL` without destructor ; `map_clear` and `map_destroy_all` do not apply their destructor on them). They can be modified though,
+// > without modifying the file (a copy-on-write private mapping is used). Pages of the file not modified are shared with the other processes mapping the same file.
+// Complexity : n. MT-safe. Loading is bound by input/output.
+
+// #### Journal the modifications of a map
+int map_set_journal (map *, int fd, map_serializer serializer);
+// Appends, from now on, each insertion into and removal from the map, serialized by `serializer`, to the journal file open as `fd` (for reading and writing).
+// A journal can be set only once for a map, before it is modified by other threads. It is closed when the map is destroyed (but `fd` is not closed.)
+// If `fd` is an existing journal (replayed by `map_replay_journal`), records are appended after its last complete record: a record torn by an interruption is cut off first.
+// A modification is durable (written and synchronised to storage) when the function that made it returns (`map_insert_data`, `map_find_key`, `map_traverse`...)
+// Returns `1` on success, `0` otherwise (with `errno` set to `EPERM` if a journal is already set.)
+// > Group commit: concurrent threads modifying the map share the synchronisations of the journal to storage. Ten threads inserting together do not cost ten synchronisations.
+// > Journaling stops if the journal can not be written (an error is then reported on `stderr`, with `errno` set to `EIO`), till the next successful `map_checkpoint`.
+// Complexity : 1 (plus the serialization) per modification. MT-safe. Bound by input/output.
+
+size_t map_replay_journal (map *, const char *path, map_serializer serializer, map_deserializer deserializer, void (*dtor) (void *));
+// Replays, on the map, the modifications recorded in the journal file `path`: inserts the data rebuilt by `deserializer`, and removes the elements which serialized form is recorded as removed.
+// Removed data are destroyed by `dtor` (if not null), except those used in place in a file mapped by `map_load_mmap`.
+// A modification interrupted while being recorded is ignored (it had not been acknowledged.)
+// The records of a journal older than the checkpoint the map was loaded from (the system stopped while the checkpoint was being completed, or modifications were journaled meanwhile) are ignored:
+// their modifications are in the checkpoint.
+// Returns the number of replayed modifications, or `0` on failure (with `errno` set.)
+// > To recover a durable map after a restart: load its last checkpoint with `map_load_mmap`, replay its journal with `map_replay_journal` and set its journal again with `map_set_journal`.
+/* Example:
+
+  map *m = map_create (get_key, cmp_key, 0, 0);
+  map_load_mmap (m, "state", deserializer);                                 // The last checkpoint, if any.
+  map_replay_journal (m, "state.journal", serializer, deserializer, free);  // The modifications since.
+  map_set_journal (m, open ("state.journal", O_RDWR | O_CREAT | O_APPEND, 0644), serializer);
+  ...
+  map_checkpoint (m, "state", serializer);                                  // From time to time, to keep the journal short.
+*/
+// Complexity : m.log n, where m is the number of modifications in the journal. MT-safe.
+
+// ### Operate atomically on several maps
+int map_transaction (map *maps[], size_t nb_maps, int (*op) (void *op_arg), void *op_arg);
+// Locks all the maps `maps[0]` to `maps[nb_maps - 1]`, calls `op (op_arg)` and unlocks the maps.
+// Returns the value returned by `op`, or `0` if `op` is null (with `errno` set to `EINVAL`).
+// The maps are always locked in the same (canonical) order, whatever the order of `maps`: concurrent transactions on intersecting sets of maps cannot deadlock.
+// Null and repeated maps in `maps` are ignored.
+// Inside `op`, all the functions of the interface can be called on the locked maps (and on others). Therefore, `op` is executed atomically with respect to the other threads using the locked maps.
+// Complexity : nb_maps^2. MT-safe. Non-recursive.
+/* Example: to move elements from map `a` to map `b` and other elements from map `b` to map `a` atomically, without any risk of deadlock with another thread doing the same in the opposite direction:
+
+  static int
+  swap_elements (void *arg)
+  {
+    map **ab = arg;
+    map_traverse (ab[0], MAP_MOVE_TO, ab[1], sel_a, 0);
+    map_traverse (ab[1], MAP_MOVE_TO, ab[0], sel_b, 0);
+    return 1;
+  }
+
+  map_transaction ((map *[]){ a, b }, 2, swap_elements, (map *[]){ a, b });
+
+*/
 
 // ### Predefined helpers
 
@@ -321,7 +585,9 @@ extern const map_operator MAP_REMOVE_ALL;
 // This map operator moves each element selected by `map_find_key`, `map_traverse` or `map_traverse_backward` to another **different** map passed in the argument `op_arg` of `map_find_key`, `map_traverse` or `map_traverse_backward`.
 extern const map_operator MAP_MOVE_TO;
 // > - A destination map identical to the source map would **deadly lock** the calling thread.
+// > - The source map and then the destination map are locked. If other threads lock them in the opposite order, both maps should rather be locked together by `map_transaction`.
 // > - Elements that do not respect the unicity constraint of the destination map will not be moved and will remain in the source map.
+// > - Elements are transplanted from the source map to the destination map: moving an element does not allocate (nor free) any memory.
 
 // #### Map operator to copy elements from one map to another
 // This map operator copies each element selected by `map_find_key`, `map_traverse` or `map_traverse_backward` to another **different** map passed in the argument `op_arg` of `map_find_key`, `map_traverse` or `map_traverse_backward`.
@@ -330,6 +596,61 @@ extern const map_operator MAP_COPY_REF_TO;
 // > - Elements that do not respect the unicity constraint of the destination map will not be copied.
 // > - The elements are *not* duplicated, and are therefore *shared* (by reference) by both source and destination map. They should be free'd only *once*.
 
+// ### Get statistics on the usage of a map
+struct map_stats {
+  // Counters, since the creation of the map or the last reset:
+  size_t nb_comparisons;           // Calls to the key comparator (but the consistency checks of `map_display`)
+  size_t nb_insertions;            // Calls to `map_insert_data`
+  size_t nb_finds;                 // Calls to `map_find_key`
+  size_t nb_traversals;            // Calls to `map_traverse` and `map_traverse_backward`
+  size_t nb_removals;              // Elements removed
+  size_t nb_rebuilds;              // Rebuilds of the whole tree, in n (after many removals while traversing, or when splaying is switched off)
+  size_t nb_locks;                 // Acquisitions of the mutex of the map
+  size_t nb_contended_locks;       // Acquisitions for which the mutex was held by another thread
+  unsigned long long lock_wait_ns; // Time spent waiting for the mutex held by another thread (in nanoseconds, measured on a monotonic clock)
+  size_t nb_allocations;           // Elements allocated
+  // Gauges, at the time of the call:
+  size_t overhead;                 // Memory used by the map and its elements, data excluded (in bytes)
+  size_t max_equal_keys;           // Number of elements of the longest list of elements with equal keys
+};
+int map_stats (map *, struct map_stats *stats, int reset);
+// Copies the statistics of a map into `*stats`, and resets the counters if `reset` is not `0`.
+// Returns `1`, or `0` if `map` or `stats` is null (with `errno` set to `EINVAL`).
+// > The counters are updated under the mutex of the map, at no extra cost of synchronisation.
+// > Only contended acquisitions of the mutex are timed.
+// Complexity : n (the gauges are measured). MT-safe. Non-recursive.
+
+// ### Profile the contention on the mutex of a map
+#include <stdio.h>
+int map_lock_profile (map *, FILE *stream, int reset);
+// Displays on `stream`, for each call site (function of the library) that locks the map, the number of acquisitions of the mutex of the map,
+// and the log-scale histograms of the time spent waiting for the mutex and holding it, and resets them if `reset` is not `0`.
+// This tells which map, and which operation on it, is the point of serialisation of the threads under load.
+// Returns `1`, or `0` if the library was not compiled with `MAP_LOCK_PROFILING` defined (with `errno` set to `ENOTSUP`).
+// > Profiling is opt-in, at compile time, by defining `MAP_LOCK_PROFILING` (for instance `make CPPFLAGS=-DMAP_LOCK_PROFILING`).
+// > It then costs two readings of the clock per acquisition of the mutex, and one per release, recorded under the mutex of the map.
+// > Nested acquisitions (by functions called from inside an operator) are accounted to the outermost one.
+// Complexity : 1. MT-safe. Non-recursive.
+
+// ### Static tracepoints
+// If `<sys/sdt.h>` (systemtap-sdt-dev) is available when the library is compiled, static tracepoints (USDT) are defined
+// on which tools such as `bpftrace` or `perf` can be attached to a running process, without rebuilding it.
+// A tracepoint is a single `nop` instruction as long as no tracer is attached.
+// Define `MAP_NO_PROBES` at compilation to leave them out.
+// - provider `map`:
+//   - `insert__entry (map, data)`, `insert__return (map, data, inserted)` ;
+//   - `find__entry (map, key)`, `find__return (map, key, number of elements)` ;
+//   - `traverse__entry (map, backward)`, `traverse__return (map, number of elements)` ;
+//   - `remove (map, data)` ;
+//   - `rotate__left (map, data)`, `rotate__right (map, data)`, on each rotation of a node of the tree (data of the rotated node) ;
+//   - `lock__acquire (map, function, nanoseconds waited)`, `lock__release (map)`.
+// - provider `timer` (see `timer.h`):
+//   - `arm (timer, seconds, nanoseconds)`, `fire (timer, arg)`, `cancel (timer, cancelled)`.
+
+/* Example:
+  bpftrace -e 'usdt:./libmap.so:map:lock__acquire /arg2 > 10000/ { @[str (arg1)] = hist (arg2); }' -p $PID
+*/
+
 // ## For debugging purpose
 // > For fans only.
 // ### Display the internal structure of the BBT of a map
@@ -346,5 +667,9 @@ extern void (*const SHAPE) (FILE *stream, const void *data);
 size_t map_height (map *);
 
 size_t map_nb_balancing (map *m);
+// Returns the number of rotations done to keep the tree balanced since the creation of the map (rebuilds of the whole tree are counted apart, by `map_stats`).
+// > The tree is balanced as an AVL tree, the only balancing scheme available. The balancing criterion can be relaxed at compile time by defining `MAP_BALANCING_THRESHOLD`
+// (the maximum difference of heights between the two subtrees of a node, `1` by default) to a higher value, for fewer rotations but higher trees, or to `0` to disable balancing.
+// > `make bench_balancing` compares the comparisons of keys, rotations, heights and times per operation of several thresholds on the workloads of the benchmark.
 
 #endif
@@ -8,6 +8,19 @@
 #include <threads.h>
 #include <time.h>
 
+// Static tracepoints (USDT) of the provider 'timer', if <sys/sdt.h> is available (and MAP_NO_PROBES is not defined.) See "Static tracepoints" in map.h.
+#if defined(__has_include) && !defined(MAP_NO_PROBES)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define timer_probe2(name, a, b) DTRACE_PROBE2 (timer, name, a, b)
+#    define timer_probe3(name, a, b, c) DTRACE_PROBE3 (timer, name, a, b, c)
+#  endif
+#endif
+#ifndef timer_probe2
+#  define timer_probe2(name, a, b) ((void)0)
+#  define timer_probe3(name, a, b, c) ((void)0)
+#endif
+
 #define map_display(...)
 
 struct timer_elem {
@@ -96,6 +109,7 @@ Timers_loop (void *) {
       }
       map_display (Timers.map, stderr, displayer);
       if (cnd_timedwait (&Timers.condition, &Timers.mutex, &earliest->timeout) == thrd_timedout) {
+        timer_probe2 (fire, earliest, earliest->arg);
         if (earliest->callback)
           earliest->callback (earliest->arg);
         Timers_rm (earliest);
@@ -112,8 +126,7 @@ Timers_clear (void) {
   cnd_broadcast (&Timers.condition);
   thrd_join (Timers.thread, 0);
   if (Timers.map) {
-    map_traverse (Timers.map, MAP_REMOVE_ALL, free, 0, 0);
-    map_destroy (Timers.map);
+    map_destroy_all (Timers.map, free);
   }
   cnd_destroy (&Timers.condition);
   mtx_destroy (&Timers.mutex);
@@ -149,6 +162,7 @@ timer_set (struct timespec timeout, void (*callback) (void *arg), void *arg) {
   call_once (&TIMERS_INIT, Timers_init);
   cnd_broadcast (&Timers.condition);
   void *ret = Timers_add (timeout, callback, arg);
+  timer_probe3 (arm, ret, timeout.tv_sec, timeout.tv_nsec);
   return ret;
 }
 
@@ -156,5 +170,6 @@ int
 timer_unset (void *timer) {
   cnd_broadcast (&Timers.condition);
   int ret = Timers_rm (timer);
+  timer_probe2 (cancel, timer, ret);
   return ret;
 }
@@ -2,17 +2,316 @@
 #ifndef __TRACE__
 #include <stdio.h>
 #include <threads.h>
-#define __TRACE__(text) fprintf (stderr, "[%lX:%s] %s <%s:%d>\n", thrd_current (), __func__, (text), __FILE__, __LINE__)
+#ifdef TRACE_RING
+#  include <stdarg.h>
+#  include <stdatomic.h>
+#  include <stdint.h>
+#  include <stdlib.h>
+#  include <string.h>
+#  include <time.h>
+#  define __TRACE__(text) trace_ring_record_ ((text), __func__, __FILE__, __LINE__, 0)
+#else
+#  define __TRACE__(text) fprintf (stderr, "[%lX:%s] %s <%s:%d>\n", thrd_current (), __func__, (text), __FILE__, __LINE__)
+#endif
 // ## DEFINITIONS
 // Use `#define function(...) TRACE_EXPRESSION(function (__VA_ARGS__))` to trace all calls to `function` to the standard error stream.
 #define TRACE_EXPRESSION(expr) (__TRACE__ (#expr), (expr))
 // Use `TRACE_FORMAT (fmt, args);` to log a message to the standard error stream.
-#define TRACE_FORMAT(...)                                     \
-  do {                                                        \
-    fprintf (stderr, "[%lX:%s] ", thrd_current (), __func__); \
-    fprintf (stderr, __VA_ARGS__);                            \
-    fprintf (stderr, " <%s:%d>\n", __FILE__, __LINE__);       \
-  } while (0)
+#ifdef TRACE_RING
+#  define TRACE_FORMAT(...) trace_ring_record_ (0, __func__, __FILE__, __LINE__, __VA_ARGS__)
+#else
+#  define TRACE_FORMAT(...)                                     \
+    do {                                                        \
+      fprintf (stderr, "[%lX:%s] ", thrd_current (), __func__); \
+      fprintf (stderr, __VA_ARGS__);                            \
+      fprintf (stderr, " <%s:%d>\n", __FILE__, __LINE__);       \
+    } while (0)
+#endif
+
+#ifdef TRACE_RING
+// ## RING BUFFERS
+// If `TRACE_RING` is defined before `trace.h` is included (`make CPPFLAGS=-DTRACE_RING`), calls are not written to the standard error stream any more
+// but recorded in memory, without any lock nor I/O, as compact binary records in a ring buffer per thread.
+// The ring of a thread keeps its last `TRACE_RING_SIZE` records (a power of 2, 4096 by default) ; older records are overwritten.
+#  ifndef TRACE_RING_SIZE
+#    define TRACE_RING_SIZE 4096
+#  endif
+// The message of `TRACE_FORMAT` is truncated to `TRACE_RING_MESSAGE` characters (that of `TRACE_EXPRESSION` is not copied.)
+#  ifndef TRACE_RING_MESSAGE
+#    define TRACE_RING_MESSAGE 24
+#  endif
+enum trace_ring_format { TRACE_RING_TEXT, TRACE_RING_CHROME };
+// `trace_ring_dump (stream, format)` writes the records of all the threads to `stream`, as lines of text (`TRACE_RING_TEXT`)
+// or as Chrome trace-event JSON (`TRACE_RING_CHROME`), to be viewed as a timeline (in chrome://tracing or https://ui.perfetto.dev.)
+// The records are dumped at exit to the file named by the environment variable `TRACE_RING`, if set (in JSON if its name ends with `.json`.)
+// > The dump should be requested while the threads do not record anything (after they are joined, for instance.)
+// > Records are not written to the stream in chronological order between threads, but each one is timestamped.
+// > The registry of rings is local to each translation unit including `trace.h`.
+
+// A call site is identified by its text (expression or format), function, file and line, all static strings.
+struct trace_record_ {
+  uint64_t ns;
+  const char *text, *func, *file;
+  int line;
+  char message[TRACE_RING_MESSAGE];
+};
+
+struct trace_ring_ {
+  struct trace_ring_ *next;
+  unsigned long thread;
+  size_t index; // Index of the thread, in order of their first record.
+  atomic_size_t head; // Number of records written since the start of the thread.
+  struct trace_record_ records[TRACE_RING_SIZE];
+};
+
+static _Atomic (struct trace_ring_ *) trace_rings_;
+static atomic_size_t trace_nb_rings_;
+static thread_local struct trace_ring_ *trace_ring_;
+static once_flag trace_ring_once_ = ONCE_FLAG_INIT;
+
+static inline void trace_ring_dump (FILE *stream, enum trace_ring_format format);
+
+static inline void
+trace_ring_exit_ (void) {
+  const char *path = getenv ("TRACE_RING");
+  FILE *stream;
+  if (!path || !*path || !(stream = fopen (path, "w")))
+    return;
+  size_t length = strlen (path);
+  trace_ring_dump (stream, length > 5 && !strcmp (path + length - 5, ".json") ? TRACE_RING_CHROME : TRACE_RING_TEXT);
+  fclose (stream);
+}
+
+static inline void
+trace_ring_init_ (void) {
+  atexit (trace_ring_exit_);
+}
+
+static inline void
+trace_ring_record_ (const char *text, const char *func, const char *file, int line, const char *format, ...) {
+  struct trace_ring_ *ring = trace_ring_;
+  if (!ring) {
+    call_once (&trace_ring_once_, trace_ring_init_);
+    if (!(ring = trace_ring_ = calloc (1, sizeof (*ring)))) // Kept until exit, for the records to be dumped after the thread has terminated.
+      return;
+    ring->thread = (unsigned long)thrd_current ();
+    ring->index = atomic_fetch_add (&trace_nb_rings_, 1);
+    ring->next = atomic_load (&trace_rings_);
+    while (!atomic_compare_exchange_weak (&trace_rings_, &ring->next, ring))
+      /* Retry */;
+  }
+  size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  struct trace_record_ *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  struct timespec ts;
+#  ifdef CLOCK_MONOTONIC
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+#  else
+  timespec_get (&ts, TIME_UTC);
+#  endif
+  record->ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  record->text = text ? text : format;
+  record->func = func;
+  record->file = file;
+  record->line = line;
+  record->message[0] = 0;
+  if (!text && format) {
+    va_list args;
+    va_start (args, format);
+    vsnprintf (record->message, sizeof (record->message), format, args);
+    va_end (args);
+  }
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+}
+
+static inline void
+trace_ring_escape_ (FILE *stream, const char *string) { // As a JSON string
+  fputc ('"', stream);
+  for (; string && *string; string++)
+    if (*string == '"' || *string == '\\')
+      fprintf (stream, "\\%c", *string);
+    else if ((unsigned char)*string < 0x20)
+      fprintf (stream, "\\u%04x", (unsigned char)*string);
+    else
+      fputc (*string, stream);
+  fputc ('"', stream);
+}
+
+static inline void
+trace_ring_dump (FILE *stream, enum trace_ring_format format) {
+  const char *separator = "";
+  if (format == TRACE_RING_CHROME)
+    fprintf (stream, "{\"traceEvents\": [\n");
+  for (struct trace_ring_ *ring = atomic_load (&trace_rings_); ring; ring = ring->next) {
+    size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+    size_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    if (format == TRACE_RING_CHROME) {
+      fprintf (stream, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%lX\", \"overwritten\": %zu}}",
+               separator, ring->index, ring->thread, first);
+      separator = ",\n";
+    } else if (first)
+      fprintf (stream, "[%lX] %zu records overwritten\n", ring->thread, first);
+    for (size_t i = first; i < head; i++) {
+      const struct trace_record_ *record = &ring->records[i & (TRACE_RING_SIZE - 1)];
+      if (format == TRACE_RING_CHROME) {
+        fprintf (stream, "%s  {\"name\": ", separator);
+        trace_ring_escape_ (stream, record->text);
+        fprintf (stream, ", \"cat\": ");
+        trace_ring_escape_ (stream, record->func);
+        fprintf (stream, ", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %zu, \"args\": {\"file\": ", (double)record->ns / 1e3,
+                 ring->index);
+        trace_ring_escape_ (stream, record->file);
+        fprintf (stream, ", \"line\": %d, \"message\": ", record->line);
+        trace_ring_escape_ (stream, record->message);
+        fprintf (stream, "}}");
+      } else
+        fprintf (stream, "%llu.%09llu [%lX:%s] %s <%s:%d>\n", (unsigned long long)(record->ns / 1000000000ULL),
+                 (unsigned long long)(record->ns % 1000000000ULL), ring->thread, record->func, record->message[0] ? record->message : record->text,
+                 record->file, record->line);
+    }
+  }
+  if (format == TRACE_RING_CHROME)
+    fprintf (stream, "\n]}\n");
+  fflush (stream);
+}
+#endif
+
+// ## LATENCIES
+// Use `#define function(...) TRACE_LATENCY(function (__VA_ARGS__))` to measure the latency of all calls to `function`.
+// If `TRACE_HISTOGRAMS` is defined before `trace.h` is included (`make CPPFLAGS=-DTRACE_HISTOGRAMS`), the duration of each call is recorded,
+// with the monotonic clock, in a histogram per call site, by logarithmic buckets of 16 linear sub-buckets each (as HDR histograms), that is with a precision of about 6%.
+// The histograms are written to the standard error stream at exit, or at will with `trace_latency_dump (stream)`.
+// Otherwise, `TRACE_LATENCY` only evaluates its argument.
+// > `TRACE_HISTOGRAMS` requires the GNU extensions (statement expressions and the `cleanup` attribute) ; it is ignored otherwise.
+#if defined(TRACE_HISTOGRAMS) && (defined(__GNUC__) || defined(__clang__))
+#  include <stdatomic.h>
+#  include <stdint.h>
+#  include <stdlib.h>
+#  include <time.h>
+// Only one call out of `TRACE_LATENCY_SAMPLING` (1 by default), per call site and thread, is timed, to lower the overhead of the clock on frequent calls.
+#  ifndef TRACE_LATENCY_SAMPLING
+#    define TRACE_LATENCY_SAMPLING 1
+#  endif
+#  define TRACE_LATENCY_BUCKETS_ (61 * 16)
+
+struct trace_latency_site_ {
+  const char *text, *func, *file;
+  int line;
+  atomic_flag registered;
+  struct trace_latency_site_ *next;
+  atomic_uint_least64_t nb_calls, sum, min, max; // min is 0 as long as no call has been timed.
+  atomic_uint_least64_t buckets[TRACE_LATENCY_BUCKETS_];
+};
+
+struct trace_latency_timer_ {
+  struct trace_latency_site_ *site;
+  uint64_t start; // 0 if the call is not sampled.
+};
+
+static _Atomic (struct trace_latency_site_ *) trace_latency_sites_;
+static once_flag trace_latency_once_ = ONCE_FLAG_INIT;
+
+static inline void trace_latency_dump (FILE *stream);
+
+static inline uint64_t
+trace_latency_now_ (void) {
+  struct timespec ts;
+#  ifdef CLOCK_MONOTONIC
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+#  else
+  timespec_get (&ts, TIME_UTC);
+#  endif
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec + 1; // Never 0
+}
+
+static inline size_t
+trace_latency_bucket_ (uint64_t ns) {
+  if (ns < 16)
+    return (size_t)ns;
+  int exponent = 63 - __builtin_clzll (ns); // 4 to 63
+  return (size_t)(exponent - 3) * 16 + (size_t)((ns >> (exponent - 4)) & 15);
+}
+
+static inline uint64_t
+trace_latency_lower_ (size_t bucket) { // Lower bound of the durations of a bucket
+  if (bucket < 16)
+    return bucket;
+  return (uint64_t)(16 + bucket % 16) << (bucket / 16 - 1);
+}
+
+static inline void
+trace_latency_exit_ (void) {
+  trace_latency_dump (stderr);
+}
+
+static inline void
+trace_latency_init_ (void) {
+  atexit (trace_latency_exit_);
+}
+
+static inline struct trace_latency_timer_
+trace_latency_start_ (struct trace_latency_site_ *site, unsigned *nb_calls) {
+  if (!atomic_flag_test_and_set (&site->registered)) {
+    call_once (&trace_latency_once_, trace_latency_init_);
+    site->next = atomic_load (&trace_latency_sites_);
+    while (!atomic_compare_exchange_weak (&trace_latency_sites_, &site->next, site))
+      /* Retry */;
+  }
+  atomic_fetch_add_explicit (&site->nb_calls, 1, memory_order_relaxed);
+  return (struct trace_latency_timer_){ .site = site, .start = ++*nb_calls % TRACE_LATENCY_SAMPLING ? 0 : trace_latency_now_ () };
+}
+
+static inline void
+trace_latency_stop_ (struct trace_latency_timer_ *timer) {
+  if (!timer->start)
+    return;
+  struct trace_latency_site_ *site = timer->site;
+  uint64_t ns = trace_latency_now_ () - timer->start;
+  atomic_fetch_add_explicit (&site->buckets[trace_latency_bucket_ (ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&site->sum, ns, memory_order_relaxed);
+  uint64_t min = atomic_load_explicit (&site->min, memory_order_relaxed);
+  while ((!min || ns < min) && !atomic_compare_exchange_weak_explicit (&site->min, &min, ns, memory_order_relaxed, memory_order_relaxed))
+    /* Retry */;
+  uint64_t max = atomic_load_explicit (&site->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit (&site->max, &max, ns, memory_order_relaxed, memory_order_relaxed))
+    /* Retry */;
+}
+
+// The latency is measured from the evaluation of `expr` up to the exit of the statement expression, after `expr` has been evaluated, whatever its type (even void.)
+#  define TRACE_LATENCY(expr)                                                                                                                     \
+    ({                                                                                                                                            \
+      static struct trace_latency_site_ trace_latency_site_ = { .text = #expr, .func = __func__, .file = __FILE__, .line = __LINE__ };            \
+      static thread_local unsigned trace_latency_nb_calls_;                                                                                       \
+      __attribute__ ((cleanup (trace_latency_stop_))) struct trace_latency_timer_ trace_latency_timer_ =                                             \
+        trace_latency_start_ (&trace_latency_site_, &trace_latency_nb_calls_);                                                                    \
+      (void)trace_latency_timer_;                                                                                                                 \
+      (expr);                                                                                                                                     \
+    })
+
+// `trace_latency_dump (stream)` writes, for each call site, the number of calls and timed calls, and the minimum, mean, median (p50), p99, p999 and maximum latencies.
+static inline void
+trace_latency_dump (FILE *stream) {
+  for (struct trace_latency_site_ *site = atomic_load (&trace_latency_sites_); site; site = site->next) {
+    uint64_t nb_timed = 0, counts[TRACE_LATENCY_BUCKETS_];
+    for (size_t i = 0; i < TRACE_LATENCY_BUCKETS_; i++)
+      nb_timed += counts[i] = atomic_load_explicit (&site->buckets[i], memory_order_relaxed);
+    static const double quantiles[] = { .5, .99, .999 };
+    uint64_t percentiles[3] = { 0 }, seen = 0;
+    for (size_t i = 0, q = 0; i < TRACE_LATENCY_BUCKETS_ && q < 3; i++)
+      for (seen += counts[i]; q < 3 && counts[i] && (double)seen >= quantiles[q] * (double)nb_timed; q++)
+        percentiles[q] = (trace_latency_lower_ (i) + trace_latency_lower_ (i + 1) - 1) / 2; // Middle of the bucket
+    for (size_t q = 0; q < 3; q++) // The extremes are exact.
+      percentiles[q] = percentiles[q] < site->min ? site->min : percentiles[q] > site->max ? site->max : percentiles[q];
+    fprintf (stream, "[%s] %s <%s:%d>: %llu calls, %llu timed, min %llu ns, mean %.0f ns, p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n", site->func,
+             site->text, site->file, site->line, (unsigned long long)atomic_load (&site->nb_calls), (unsigned long long)nb_timed,
+             (unsigned long long)atomic_load (&site->min), nb_timed ? (double)atomic_load (&site->sum) / (double)nb_timed : 0.,
+             (unsigned long long)percentiles[0], (unsigned long long)percentiles[1], (unsigned long long)percentiles[2],
+             (unsigned long long)atomic_load (&site->max));
+  }
+  fflush (stream);
+}
+#else
+#  define TRACE_LATENCY(expr) (expr)
+#endif
 
 /*
 ## USAGE
@@ -23,6 +322,23 @@ If `function` is a function (user-defined or external), write:
 to trace all calls to `function` to the standard error stream.
 > If `function` is a user-defined function, this should be written **just after** its definition.
 
+To trace without disturbing the timing of the traced program (in production for instance), compile it with `-DTRACE_RING`
+and run it with the environment variable `TRACE_RING` set to the name of the file to dump the records to at exit:
+
+    cc -DTRACE_RING -o test_trace test_trace.c
+    TRACE_RING=trace.json ./test_trace
+
+or call `trace_ring_dump (stream, TRACE_RING_TEXT)` at will.
+
+To measure latencies rather than trace calls, write:
+
+    #define function(...) TRACE_LATENCY(function (__VA_ARGS__))
+
+compile with `-DTRACE_HISTOGRAMS`, and the percentiles of the latency of each call site are written to the standard error stream at exit, as:
+
+    [main] map_insert_data (m, &keys[i]) <bench.c:42>: 100000 calls, 100000 timed, min 61 ns, mean 402 ns, p50 375 ns, p99 1151 ns, p999 3455 ns, max 40291 ns
+The timestamps are given by the monotonic clock, or by the calendar time if `CLOCK_MONOTONIC` is not declared (in strict ISO C mode.)
+
 ## EXAMPLE
 For instance, the following program:
 